@@ -0,0 +1,347 @@
+/*
+ * Benchmark of the whole element, videotestsrc ! mocklens ! multifocus ! fakesink,
+ * with the test build of the plugin whose lens is simulated by mockLens.h so
+ * that it runs headless and without I2C.
+ *
+ * It measures the throughput of the chain function, the time it adds to each buffer,
+ * the number of frames taken by the detection sweep and the error of the
+ * detected plans against the focus of the simulated scene. The results are
+ * printed as JSON and can be checked against a baseline, one metric per line:
+ *
+ *     <metric> <min|max> <reference> <tolerance in %>
+ *
+ * "min" metrics must not fall below the reference by more than the
+ * tolerance, "max" metrics must not exceed it by more than the tolerance.
+ * Lines starting with # are comments. The timings depend on the board and
+ * are only checked once they have a reference, the detection metrics always
+ * need one. The exit status is 1 on a regression or a missing reference.
+ *
+ * usage: bench-pipeline [--frames n] [--width w] [--height h]
+ *                       [--baseline file] [--write-baseline file]
+ *
+ * The test build of the plugin is looked up in GST_PLUGIN_PATH, the shipped
+ * one has no "mocklens" element.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gst/gst.h>
+
+#include "mockLens.h"
+
+#define MAX_METRICS 16
+#define DEFAULT_FOCUS "-50;350"
+
+typedef struct metric
+{
+    const char *name;
+    double value;
+    gboolean higherIsBetter;    // Throughput, as opposed to latencies and errors
+    gboolean required;          // Checked even without a reference, as opposed to the board dependent timings
+} Metric;
+
+typedef struct benchRun
+{
+    gint frames;                // Buffers that went in the element
+    gint sweepFrames;           // Buffers in when the detection was posted, 0 if none
+    int plans[MOCK_LENS_MAX_PLANES];
+    int nbPlans;
+} BenchRun;
+
+static GstPadProbeReturn countBuffer(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    BenchRun *run = (BenchRun *)data;
+
+    g_atomic_int_inc(&run->frames);
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* Called in the streaming thread, so that the frame count is the one of the detection */
+static GstBusSyncReply catchDetection(GstBus *bus, GstMessage *message, gpointer data)
+{
+    BenchRun *run = (BenchRun *)data;
+    const GstStructure *s;
+    const GValue *plans;
+
+    if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_ELEMENT)
+        return GST_BUS_PASS;
+
+    s = gst_message_get_structure(message);
+    if (!gst_structure_has_name(s, "multifocus-detection") || run->sweepFrames > 0)
+        return GST_BUS_PASS;
+
+    run->sweepFrames = g_atomic_int_get(&run->frames);
+    plans = gst_structure_get_value(s, "plans");
+    run->nbPlans = 0;
+    for (guint i = 0; plans != NULL && i < gst_value_array_get_size(plans) && run->nbPlans < MOCK_LENS_MAX_PLANES; i++)
+    {
+        run->plans[run->nbPlans++] = g_value_get_int(gst_value_array_get_value(plans, i));
+    }
+
+    return GST_BUS_PASS;
+}
+
+/* Largest distance between the focus of a band and the closest plan found */
+static int detectionError(const BenchRun *run)
+{
+    int worst = 0;
+
+    if (run->nbPlans == 0)
+        return G_MAXINT;
+
+    for (int band = 0; band < mockLensBands(); band++)
+    {
+        int best = G_MAXINT;
+
+        for (int i = 0; i < run->nbPlans; i++)
+        {
+            best = MIN(best, ABS(run->plans[i] - mockLensFocus(band)));
+        }
+        worst = MAX(worst, best);
+    }
+
+    return worst;
+}
+
+static guint64 statsValue(GstElement *multifocus, const char *field)
+{
+    GstStructure *stats = NULL;
+    guint64 value = 0;
+
+    g_object_get(multifocus, "stats", &stats, NULL);
+    if (stats != NULL)
+    {
+        gst_structure_get_uint64(stats, field, &value);
+        gst_structure_free(stats);
+    }
+
+    return value;
+}
+
+/* Check the metrics against the baseline, returns the number of regressions
+ * and missing references of the required metrics or -1.
+ */
+static int checkBaseline(const char *path, const Metric *metrics, int nbMetrics)
+{
+    FILE *file = fopen(path, "r");
+    char line[256];
+    int regressions = 0;
+    gboolean checked[MAX_METRICS] = { FALSE };
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Unable to open the baseline %s\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char name[64], bound[8];
+        double reference, tolerance, limit;
+        const Metric *metric = NULL;
+
+        if (line[0] == '#' || sscanf(line, "%63s %7s %lf %lf", name, bound, &reference, &tolerance) != 4)
+            continue;
+
+        for (int i = 0; i < nbMetrics; i++)
+        {
+            if (strcmp(metrics[i].name, name) == 0)
+            {
+                metric = &metrics[i];
+                checked[i] = TRUE;
+            }
+        }
+        if (metric == NULL)
+        {
+            fprintf(stderr, "Unknown metric %s in the baseline\n", name);
+            regressions++;
+            continue;
+        }
+
+        if (strcmp(bound, "min") == 0)
+        {
+            limit = reference * (1.0 - (tolerance / 100.0));
+            if (metric->value < limit)
+            {
+                fprintf(stderr, "REGRESSION %s: %.2f below %.2f (reference %.2f - %.0f%%)\n",
+                        name, metric->value, limit, reference, tolerance);
+                regressions++;
+            }
+        }
+        else
+        {
+            limit = reference * (1.0 + (tolerance / 100.0));
+            if (metric->value > limit)
+            {
+                fprintf(stderr, "REGRESSION %s: %.2f above %.2f (reference %.2f + %.0f%%)\n",
+                        name, metric->value, limit, reference, tolerance);
+                regressions++;
+            }
+        }
+    }
+
+    fclose(file);
+
+    // A required metric without a reference would never catch a regression
+    for (int i = 0; i < nbMetrics; i++)
+    {
+        if (!checked[i] && metrics[i].required)
+        {
+            fprintf(stderr, "MISSING %s: no reference in %s, record one with --write-baseline\n", metrics[i].name, path);
+            regressions++;
+        }
+        else if (!checked[i])
+        {
+            fprintf(stderr, "SKIPPED %s: no reference in %s\n", metrics[i].name, path);
+        }
+    }
+
+    return regressions;
+}
+
+static int writeBaseline(const char *path, const Metric *metrics, int nbMetrics)
+{
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "Unable to write the baseline %s\n", path);
+        return -1;
+    }
+
+    fprintf(file, "# metric bound reference tolerance%%\n");
+    for (int i = 0; i < nbMetrics; i++)
+    {
+        fprintf(file, "%s %s %.2f %d\n", metrics[i].name, metrics[i].higherIsBetter ? "min" : "max",
+                metrics[i].value, 20);
+    }
+
+    fclose(file);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    gint nbFrames = 300;
+    int width = 640, height = 480;
+    const char *baseline = NULL;
+    const char *newBaseline = NULL;
+    BenchRun run;
+    Metric metrics[MAX_METRICS];
+    int nbMetrics = 0;
+    gchar *description;
+    GstElement *pipeline, *multifocus;
+    GstPad *sink;
+    GstBus *bus;
+    GstMessage *message;
+    gint64 start, elapsed;
+    guint64 frameMean;
+    gboolean failed = FALSE;
+    int status = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            nbFrames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc)
+            width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc)
+            height = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+            baseline = argv[++i];
+        else if (strcmp(argv[i], "--write-baseline") == 0 && i + 1 < argc)
+            newBaseline = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: %s [--frames n] [--width w] [--height h] [--baseline file] [--write-baseline file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // The mock lens and this program read the same environment
+    g_setenv("MULTIFOCUS_MOCK_FOCUS", DEFAULT_FOCUS, FALSE);
+
+    gst_init(&argc, &argv);
+    memset(&run, 0, sizeof(run));
+
+    description = g_strdup_printf("videotestsrc pattern=checkers-8 num-buffers=%d "
+                                  "! video/x-raw,format=GRAY8,width=%d,height=%d,framerate=30/1 "
+                                  "! mocklens ! multifocus name=mf reset=true number-of-plans=%d "
+                                  "! fakesink sync=false",
+                                  nbFrames, width, height, mockLensBands());
+    pipeline = gst_parse_launch(description, NULL);
+    g_free(description);
+    if (pipeline == NULL)
+    {
+        fprintf(stderr, "Unable to build the pipeline, is the test build of the plugin in GST_PLUGIN_PATH?\n");
+        return 1;
+    }
+
+    multifocus = gst_bin_get_by_name(GST_BIN(pipeline), "mf");
+    sink = gst_element_get_static_pad(multifocus, "sink");
+    gst_pad_add_probe(sink, GST_PAD_PROBE_TYPE_BUFFER, countBuffer, &run, NULL);
+    gst_object_unref(sink);
+
+    bus = gst_element_get_bus(pipeline);
+    gst_bus_set_sync_handler(bus, catchDetection, &run, NULL);
+
+    start = g_get_monotonic_time();
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    message = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    elapsed = g_get_monotonic_time() - start;
+
+    if (message != NULL && GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR)
+    {
+        GError *error = NULL;
+
+        gst_message_parse_error(message, &error, NULL);
+        fprintf(stderr, "Pipeline error: %s\n", error->message);
+        g_error_free(error);
+        failed = TRUE;
+    }
+    if (message != NULL)
+        gst_message_unref(message);
+
+    // The frame stage times the chain function alone, the mocklens blur and the other elements are left out
+    frameMean = statsValue(multifocus, "frame-mean");
+    metrics[nbMetrics++] = (Metric){ "frames_per_second", (frameMean > 0) ? 1e6 / frameMean : 0, TRUE, FALSE };
+    metrics[nbMetrics++] = (Metric){ "latency_mean_us", (double)frameMean, FALSE, FALSE };
+    metrics[nbMetrics++] = (Metric){ "latency_p99_us", (double)statsValue(multifocus, "frame-p99"), FALSE, FALSE };
+    metrics[nbMetrics++] = (Metric){ "sharpness_p99_us", (double)statsValue(multifocus, "sharpness-p99"), FALSE, FALSE };
+    metrics[nbMetrics++] = (Metric){ "sweep_frames", (run.sweepFrames > 0) ? run.sweepFrames : G_MAXINT, FALSE, TRUE };
+    metrics[nbMetrics++] = (Metric){ "detection_error_pda", (double)detectionError(&run), FALSE, TRUE };
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(multifocus);
+    gst_object_unref(bus);
+    gst_object_unref(pipeline);
+
+    printf("{\n  \"frames\": %d,\n  \"width\": %d,\n  \"height\": %d,\n  \"plans\": [", run.frames, width, height);
+    for (int i = 0; i < run.nbPlans; i++)
+    {
+        printf("%s%d", (i > 0) ? ", " : "", run.plans[i]);
+    }
+    printf("],\n  \"pipeline_frames_per_second\": %.2f,\n", (elapsed > 0) ? run.frames * 1e6 / elapsed : 0);
+    for (int i = 0; i < nbMetrics; i++)
+    {
+        printf("  \"%s\": %.2f%s\n", metrics[i].name, metrics[i].value, (i + 1 < nbMetrics) ? "," : "");
+    }
+    printf("}\n");
+
+    if (failed)
+        status = 1;
+    else if (run.frames < nbFrames)
+    {
+        fprintf(stderr, "Only %d of the %d frames went through the element\n", run.frames, nbFrames);
+        status = 1;
+    }
+    if (newBaseline != NULL && writeBaseline(newBaseline, metrics, nbMetrics) != 0)
+        status = 1;
+    if (baseline != NULL && checkBaseline(baseline, metrics, nbMetrics) != 0)
+        status = 1;
+
+    return status;
+}
@@ -0,0 +1,248 @@
+/*
+ * Micro-benchmark of the sharpness kernels, out of any pipeline.
+ *
+ * Every kernel is timed on a synthetic GRAY8 frame for each resolution, ROI
+ * size and alignment of the frame in memory. The results are printed as a
+ * table, or as JSON with --json so that two builds or two boards can be
+ * compared.
+ *
+ * usage: bench-sharpness [--json] [--min-time seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "multifocusControl.h"
+
+#define MAX_BENCH_THREADS 8
+#define MIN_ITERATIONS 5
+
+typedef struct resolution
+{
+    const char *name;
+    int width;
+    int height;
+} Resolution;
+
+typedef enum
+{
+    KERNEL_THREAD,          // unbiasedSharpnessThread, NB_THREADS threads
+    KERNEL_SPLIT,           // unbiasedSharpnessMono spread on a given number of threads
+    KERNEL_DECIMATED,       // unbiasedSharpnessDecimated with a given decimation
+    KERNEL_TILE             // tileGradientEnergy on one thread, as the fusion and depth map do
+} KernelType;
+
+typedef struct kernel
+{
+    const char *name;
+    KernelType type;
+    int parameter;          // Number of threads or decimation
+} Kernel;
+
+static const Resolution resolutions[] = {
+    { "VGA", 640, 480 },
+    { "720p", 1280, 720 },
+    { "1080p", 1920, 1080 },
+    { "4K", 3840, 2160 },
+};
+
+static const Kernel kernels[] = {
+    { "unbiasedSharpnessThread", KERNEL_THREAD, NB_THREADS },
+    { "mono-1-thread", KERNEL_SPLIT, 1 },
+    { "mono-2-threads", KERNEL_SPLIT, 2 },
+    { "mono-4-threads", KERNEL_SPLIT, 4 },
+    { "mono-8-threads", KERNEL_SPLIT, 8 },
+    { "decimated-2", KERNEL_DECIMATED, 2 },
+    { "decimated-4", KERNEL_DECIMATED, 4 },
+    { "decimated-8", KERNEL_DECIMATED, 8 },
+    { "tileGradientEnergy", KERNEL_TILE, 1 },
+};
+
+static const int roiPercents[] = { 100, 50, 25 };  // Side of the centered ROI relative to the frame
+static const int alignments[] = { 0, 1, 3 };       // Offset of the frame from a 64 bytes boundary
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/* Textured frame with a blur gradient, so that the kernels see edges of every strength */
+static void fillFrame(guint8 *img, int width, int height)
+{
+    unsigned int seed = 12345;
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int checker = (((x / 8) + (y / 8)) & 1) ? 200 : 50;
+            int blur = (x * 4) / width;
+
+            seed = (seed * 1103515245) + 12345;
+            img[(y * width) + x] = (guint8)((checker >> blur) + ((seed >> 16) & 31));
+        }
+    }
+}
+
+/* Same split as unbiasedSharpnessThread with any number of threads */
+static long int sharpnessSplit(guint8 *img, int width, ROI roi, int nbThreads)
+{
+    pthread_t threads[MAX_BENCH_THREADS];
+    SharpnessParameters params[MAX_BENCH_THREADS];
+    long int result = 0;
+    long int average = 0;
+
+    for (int i = 0; i < nbThreads; i++)
+    {
+        params[i].threadsROI.width = roi.width;
+        params[i].threadsROI.height = roi.height / nbThreads;
+        params[i].threadsROI.x = roi.x;
+        params[i].threadsROI.y = roi.y + (params[i].threadsROI.height * i);
+        params[i].imgMat = img;
+        params[i].width = width;
+        params[i].decimation = 1;
+        params[i].result = 0;
+        params[i].average = 0;
+
+        pthread_create(&threads[i], NULL, unbiasedSharpnessMono, (void *)&params[i]);
+    }
+
+    for (int i = 0; i < nbThreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+        result += params[i].result;
+        average += params[i].average;
+    }
+
+    average /= (long int)roi.width * roi.height;
+
+    return (average == 0) ? 0 : result / average;
+}
+
+static long int runKernel(const Kernel *kernel, guint8 *img, int width, ROI roi)
+{
+    switch (kernel->type)
+    {
+    case KERNEL_THREAD:
+        return unbiasedSharpnessThread(img, width, roi);
+    case KERNEL_SPLIT:
+        return sharpnessSplit(img, width, roi, kernel->parameter);
+    case KERNEL_DECIMATED:
+        return unbiasedSharpnessDecimated(img, width, roi, kernel->parameter);
+    case KERNEL_TILE:
+        return tileGradientEnergy(img, width, roi.x, roi.y, roi.x + roi.width, roi.y + roi.height);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bool json = false;
+    double minTime = 0.2;
+    bool first = true;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+            minTime = atof(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [--json] [--min-time seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (json)
+        printf("{\n  \"nb_threads\": %d,\n  \"results\": [\n", NB_THREADS);
+    else
+        printf("%-8s %-9s %-5s %-24s %12s %10s %12s\n", "frame", "roi", "align", "kernel", "ns/pixel", "frames/s", "sharpness");
+
+    for (size_t r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); r++)
+    {
+        const Resolution *res = &resolutions[r];
+        size_t size = (size_t)res->width * res->height;
+        guint8 *storage = (guint8 *)malloc(size + 64 + 64);
+
+        if (storage == NULL)
+        {
+            fprintf(stderr, "unable to allocate a %s frame\n", res->name);
+            return 1;
+        }
+
+        for (size_t a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++)
+        {
+            guint8 *img = (guint8 *)((((size_t)storage + 63) & ~(size_t)63) + alignments[a]);
+
+            fillFrame(img, res->width, res->height);
+
+            for (size_t p = 0; p < sizeof(roiPercents) / sizeof(roiPercents[0]); p++)
+            {
+                ROI roi;
+
+                // Whole 4x4 blocks, as the kernels only visit those
+                roi.width = ((res->width * roiPercents[p]) / 100) & ~3;
+                roi.height = ((res->height * roiPercents[p]) / 100) & ~3;
+                roi.x = ((res->width - roi.width) / 2) & ~3;
+                roi.y = ((res->height - roi.height) / 2) & ~3;
+                if (roi.y + roi.height > res->height - 4)
+                    roi.height -= 4;   // The bands of the threads may end in the middle of a block
+
+                for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+                {
+                    const Kernel *kernel = &kernels[k];
+                    long int sharpness = runKernel(kernel, img, res->width, roi);   // Warm up the caches
+                    int iterations = 0;
+                    double start = now();
+                    double elapsed;
+                    double perFrame, nsPerPixel;
+
+                    do
+                    {
+                        sharpness = runKernel(kernel, img, res->width, roi);
+                        iterations++;
+                        elapsed = now() - start;
+                    } while (iterations < MIN_ITERATIONS || elapsed < minTime);
+
+                    perFrame = elapsed / iterations;
+                    nsPerPixel = (perFrame * 1e9) / ((double)roi.width * roi.height);
+
+                    if (json)
+                    {
+                        printf("%s    {\"frame\": \"%s\", \"width\": %d, \"height\": %d, \"roi_width\": %d, \"roi_height\": %d, "
+                               "\"alignment\": %d, \"kernel\": \"%s\", \"iterations\": %d, \"ns_per_pixel\": %.4f, "
+                               "\"frames_per_second\": %.2f, \"sharpness\": %ld}",
+                               first ? "" : ",\n", res->name, res->width, res->height, roi.width, roi.height,
+                               alignments[a], kernel->name, iterations, nsPerPixel, 1.0 / perFrame, sharpness);
+                        first = false;
+                    }
+                    else
+                    {
+                        char roiName[16];
+
+                        snprintf(roiName, sizeof(roiName), "%dx%d", roi.width, roi.height);
+                        printf("%-8s %-9s %-5d %-24s %12.4f %10.2f %12ld\n", res->name, roiName, alignments[a],
+                               kernel->name, nsPerPixel, 1.0 / perFrame, sharpness);
+                    }
+                    fflush(stdout);
+                }
+            }
+        }
+
+        free(storage);
+    }
+
+    if (json)
+        printf("\n  ]\n}\n");
+
+    return 0;
+}
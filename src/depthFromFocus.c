@@ -0,0 +1,112 @@
+#include "depthFromFocus.h"
+
+#include <stdlib.h>
+#include <limits.h>
+
+#include "multifocusControl.h"
+
+int depthMapInit(DepthMap *map, int width, int height, int tileSize)
+{
+    int tiles;
+
+    map->width = width;
+    map->height = height;
+    map->tileSize = tileSize;
+    map->columns = (width + tileSize - 1) / tileSize;
+    map->rows = (height + tileSize - 1) / tileSize;
+    map->samples = 0;
+
+    tiles = map->columns * map->rows;
+    map->bestEnergy = (long int*)malloc(sizeof(long int) * tiles);
+    map->minEnergy = (long int*)malloc(sizeof(long int) * tiles);
+    map->bestPda = (int*)malloc(sizeof(int) * tiles);
+
+    if (tiles <= 0 || map->bestEnergy == NULL || map->minEnergy == NULL || map->bestPda == NULL)
+    {
+        depthMapFree(map);
+        return -1;
+    }
+
+    for (int i = 0; i < tiles; i++)
+    {
+        map->bestEnergy[i] = -1;
+        map->minEnergy[i] = LONG_MAX;
+        map->bestPda[i] = 0;
+    }
+
+    return 0;
+}
+
+/* Gradient energy of one 4x4 block in decimation along each axis of the
+ * tile, always including the block at its top left corner.
+ */
+static long int decimatedTileEnergy(const unsigned char *imgMat, int stride, int x0, int y0, int x1, int y1, int decimation)
+{
+    long int energy = 0;
+
+    if (decimation <= 1)
+        return tileGradientEnergy(imgMat, stride, x0, y0, x1, y1);
+
+    for (int y = y0; y + 4 <= y1; y += 4 * decimation)
+    {
+        for (int x = x0; x + 4 <= x1; x += 4 * decimation)
+        {
+            energy += blockGradientEnergy(imgMat, (y * stride) + x, stride);
+        }
+    }
+
+    return energy;
+}
+
+void depthMapAddSample(DepthMap *map, const unsigned char *imgMat, int stride, int pda, int decimation)
+{
+    int tile = 0;
+
+    for (int y0 = 0; y0 < map->height; y0 += map->tileSize)
+    {
+        int y1 = (y0 + map->tileSize < map->height) ? y0 + map->tileSize : map->height;
+
+        for (int x0 = 0; x0 < map->width; x0 += map->tileSize)
+        {
+            int x1 = (x0 + map->tileSize < map->width) ? x0 + map->tileSize : map->width;
+            long int energy = decimatedTileEnergy(imgMat, stride, x0, y0, x1, y1, decimation);
+
+            if (energy > map->bestEnergy[tile])
+            {
+                map->bestEnergy[tile] = energy;
+                map->bestPda[tile] = pda;
+            }
+            if (energy < map->minEnergy[tile])
+                map->minEnergy[tile] = energy;
+
+            tile++;
+        }
+    }
+
+    map->samples++;
+}
+
+void depthMapExport(const DepthMap *map, short *depth, unsigned char *confidence)
+{
+    for (int i = 0; i < map->columns * map->rows; i++)
+    {
+        depth[i] = (short)map->bestPda[i];
+
+        if (map->samples == 0 || map->bestEnergy[i] <= 0)
+            confidence[i] = 0;
+        else
+            confidence[i] = (unsigned char)(((map->bestEnergy[i] - map->minEnergy[i]) * 255) / map->bestEnergy[i]);
+    }
+}
+
+void depthMapFree(DepthMap *map)
+{
+    free(map->bestEnergy);
+    free(map->minEnergy);
+    free(map->bestPda);
+
+    map->bestEnergy = NULL;
+    map->minEnergy = NULL;
+    map->bestPda = NULL;
+    map->samples = 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#define DEPTH_MIN_TILE_SIZE 4      // The tiles are measured with 4x4 blocks
+#define DEPTH_MAX_TILE_SIZE 256
+
+typedef struct depthMap
+{
+    int width;                  // The width of the frames
+    int height;                 // The height of the frames
+    int tileSize;               // The size of the square tiles
+    int columns;                // The number of tiles on a line of the map
+    int rows;                   // The number of lines of the map
+    int samples;                // The number of frames accumulated
+    long int *bestEnergy;       // Highest gradient energy seen on each tile
+    long int *minEnergy;        // Lowest gradient energy seen on each tile
+    int *bestPda;               // PDA of the frame having the highest gradient energy on each tile
+} DepthMap;
+
+/**
+ * @brief Allocate the accumulators of a depth map covering the whole frame
+ *
+ * @param map The DepthMap structure to initialize
+ * @param width The width of the frames
+ * @param height The height of the frames
+ * @param tileSize The size of the square tiles
+ * @return int 0 on success, -1 if the map couldn't be allocated
+ */
+int depthMapInit(DepthMap *map, int width, int height, int tileSize);
+
+/**
+ * @brief Accumulate a frame of the sweep, each tile keeps the PDA at which it was the sharpest
+ *
+ * @param map The DepthMap structure
+ * @param imgMat The frame data, a GRAY8 plane
+ * @param stride The number of bytes between two lines of the frame
+ * @param pda The PDA at which the frame was taken
+ * @param decimation Only one 4x4 block in decimation along each axis is measured, the same for every frame of a sweep
+ */
+void depthMapAddSample(DepthMap *map, const unsigned char *imgMat, int stride, int pda, int decimation);
+
+/**
+ * @brief Write the depth map and its confidence, both columns * rows row major
+ * The confidence is 0 for a tile whose sharpness didn't change during the sweep
+ * and 255 for a tile which was blurred everywhere but at its best PDA
+ *
+ * @param map The DepthMap structure
+ * @param depth The PDA at which each tile is the sharpest
+ * @param confidence The confidence of each tile
+ */
+void depthMapExport(const DepthMap *map, short *depth, unsigned char *confidence);
+
+/**
+ * @brief Free the accumulators of a depth map
+ *
+ * @param map The DepthMap structure
+ */
+void depthMapFree(DepthMap *map);
@@ -0,0 +1,137 @@
+#include "focusFusion.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#include "multifocusControl.h"
+
+#define FUSION_MAX_SOURCES 50
+
+static void copyTile(const unsigned char *src, unsigned char *dest, int stride, int x0, int y0, int x1, int y1)
+{
+    for (int y = y0; y < y1; y++)
+    {
+        memcpy(dest + (y * stride) + x0, src + (y * stride) + x0, x1 - x0);
+    }
+}
+
+static void blendTile(unsigned char **sources, const int *weights, int nbSources, unsigned char *dest,
+                      int stride, int x0, int y0, int x1, int y1)
+{
+    unsigned int acc[FUSION_TILE_SIZE];
+    int tileWidth = x1 - x0;
+
+    for (int y = y0; y < y1; y++)
+    {
+        int line = (y * stride) + x0;
+
+        memset(acc, 0, sizeof(acc));
+
+        // One source at a time so that the inner loop runs over contiguous pixels
+        for (int s = 0; s < nbSources; s++)
+        {
+            const unsigned char *src = sources[s] + line;
+            unsigned int w = weights[s];
+
+            if (w == 0)
+                continue;
+
+            for (int x = 0; x < tileWidth; x++)
+            {
+                acc[x] += w * src[x];
+            }
+        }
+
+        for (int x = 0; x < tileWidth; x++)
+        {
+            dest[line + x] = (acc[x] + 128) >> 8;
+        }
+    }
+}
+
+void *fuseFocalStackMono(void *params)
+{
+    FusionParameters *parameters = (FusionParameters *)params;
+
+    long int energies[FUSION_MAX_SOURCES];
+    int weights[FUSION_MAX_SOURCES];
+
+    int nbSources = parameters->nbSources;
+    int stride = parameters->stride;
+
+    for (int tileRow = parameters->firstTileRow; tileRow < parameters->lastTileRow; tileRow++)
+    {
+        int y0 = tileRow * FUSION_TILE_SIZE;
+        int y1 = (y0 + FUSION_TILE_SIZE < parameters->height) ? y0 + FUSION_TILE_SIZE : parameters->height;
+
+        for (int x0 = 0; x0 < parameters->width; x0 += FUSION_TILE_SIZE)
+        {
+            int x1 = (x0 + FUSION_TILE_SIZE < parameters->width) ? x0 + FUSION_TILE_SIZE : parameters->width;
+            long int total = 0;
+            int best = 0;
+
+            for (int s = 0; s < nbSources; s++)
+            {
+                energies[s] = tileGradientEnergy(parameters->sources[s], stride, x0, y0, x1, y1);
+                total += energies[s];
+
+                if (energies[s] > energies[best])
+                    best = s;
+            }
+
+            if (!parameters->blend || total == 0)
+            {
+                copyTile(parameters->sources[best], parameters->dest, stride, x0, y0, x1, y1);
+            }
+            else
+            {
+                // Weights in 1/256th, the rounding leftover goes to the sharpest source
+                int sum = 0;
+
+                for (int s = 0; s < nbSources; s++)
+                {
+                    weights[s] = (int)((energies[s] * 256) / total);
+                    sum += weights[s];
+                }
+                weights[best] += 256 - sum;
+
+                blendTile(parameters->sources, weights, nbSources, parameters->dest, stride, x0, y0, x1, y1);
+            }
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+void fuseFocalStack(unsigned char **sources, int nbSources, unsigned char *dest, int width, int height, int stride, bool blend)
+{
+    pthread_t threads[NB_THREADS];
+    FusionParameters params[NB_THREADS];
+
+    int tileRows = (height + FUSION_TILE_SIZE - 1) / FUSION_TILE_SIZE;
+    int band = (tileRows + NB_THREADS - 1) / NB_THREADS;
+
+    if (nbSources > FUSION_MAX_SOURCES)
+        nbSources = FUSION_MAX_SOURCES;
+
+    // Spread the rows of tiles on multiple threads
+    for (int i = 0; i < NB_THREADS; i++)
+    {
+        params[i].sources = sources;
+        params[i].nbSources = nbSources;
+        params[i].dest = dest;
+        params[i].width = width;
+        params[i].height = height;
+        params[i].stride = stride;
+        params[i].blend = blend;
+        params[i].firstTileRow = (band * i < tileRows) ? band * i : tileRows;
+        params[i].lastTileRow = (band * (i + 1) < tileRows) ? band * (i + 1) : tileRows;
+
+        pthread_create(&threads[i], NULL, fuseFocalStackMono, (void *)&params[i]);
+    }
+
+    for (int i = 0; i < NB_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
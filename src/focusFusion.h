@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+
+#define FUSION_TILE_SIZE 16    // Size of the square tiles whose source is chosen independently
+
+typedef struct fusionParameters
+{
+    unsigned char **sources;    // The frames of the focal stack
+    int nbSources;              // The number of frames in the stack
+    unsigned char *dest;        // The fused frame
+    int width;                  // The width of the frames
+    int height;                 // The height of the frames
+    int stride;                 // The number of bytes between two lines of the frames
+    int firstTileRow;           // The first row of tiles to be processed
+    int lastTileRow;            // The row of tiles following the last one to be processed
+    bool blend;                 // Blend the sources weighted by their sharpness instead of picking the sharpest one
+} FusionParameters;
+
+/**
+ * @brief Fuse a horizontal band of tiles of the focal stack
+ *
+ * @param params The FusionParameters structure describing the band
+ * @return void*
+ */
+void *fuseFocalStackMono(void *params);
+
+/**
+ * @brief Multi thread the fusion of a focal stack into an all-in-focus frame
+ * Each tile of the fused frame comes from the source having the highest gradient energy on that tile,
+ * the same metric as the one used to compute the sharpness of the frames
+ *
+ * @param sources The frames of the focal stack, all GRAY8 with the same size
+ * @param nbSources The number of frames in the stack
+ * @param dest The fused frame
+ * @param width The width of the frames
+ * @param height The height of the frames
+ * @param stride The number of bytes between two lines of the frames
+ * @param blend Blend the sources weighted by their sharpness instead of picking the sharpest one
+ */
+void fuseFocalStack(unsigned char **sources, int nbSources, unsigned char *dest, int width, int height, int stride, bool blend);
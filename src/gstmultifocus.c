@@ -64,22 +64,36 @@
 #include <signal.h>
 #include <pthread.h>
 #include <gst/gst.h>
+#include <gst/video/video.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "gstmultifocus.h"
+#include "gstmultifocusmeta.h"
+#include "focusFusion.h"
 #include "i2c_control.h"
+#ifdef MULTIFOCUS_MOCK_LENS
+#include "gstmocklens.h"
+#endif
 
 GST_DEBUG_CATEGORY_STATIC(gst_multifocus_debug);
+
+/* Lens and sweep activity for the tracers (GST_TRACERS / gst-stats) */
+static GstTracerRecord *tracer_lens;
+static GstTracerRecord *tracer_sweep;
 #define GST_CAT_DEFAULT gst_multifocus_debug
 
+#define SHARPNESS_SKIPPED G_MININT    // Apart from -1, returned by getSharpness on failure
+
 /* Filter signals and args */
 enum
 {
-    /* FILL ME */
+    SIGNAL_TRIGGER,
     LAST_SIGNAL
 };
 
+static guint gst_multifocus_signals[LAST_SIGNAL] = { 0 };
+
 enum
 {
     PROP_0,
@@ -95,7 +109,32 @@ enum
     PROP_ROI2Y,
     PROP_AUTO_DETECT_PLANS,
     PROP_NEXT,
-    PROP_PLANS
+    PROP_PLANS,
+    PROP_ANALYSIS_BUDGET_US,
+    PROP_TRANSITION_POLICY,
+    PROP_DROPPED_FRAMES,
+    PROP_OUTPUT_MODE,
+    PROP_FUSION_BLEND,
+    PROP_DEPTH_MAP,
+    PROP_DEPTH_TILE_SIZE,
+    PROP_PREDICTIVE_SWITCH,
+    PROP_CALIBRATE,
+    PROP_LENS_DELAY,
+    PROP_DIRECT_MOVES,
+    PROP_HYSTERESIS_TOLERANCE,
+    PROP_HYSTERESIS,
+    PROP_CYCLE_ORDER,
+    PROP_CYCLE_SEQUENCE,
+    PROP_SWEEP_MODE,
+    PROP_RAMP_DURATION_MS,
+    PROP_RAMP_LAG_MS,
+    PROP_DWELL_TIME,
+    PROP_PLAN_WEIGHTS,
+    PROP_ADAPTIVE_DWELL,
+    PROP_SCENE_CHANGE_THRESHOLD,
+    PROP_STATS,
+    PROP_STATS_FILE,
+    PROP_STATS_INTERVAL
    
 };
 int max_tab(int *tab, int size_of_tab);
@@ -108,7 +147,56 @@ void parseString(char* string, int *tab,int size);
 //void find_best_plan(GstPad *pad, GstBuffer *buf, int indice_test, Gstmultifocus *multifocus);
 //void find_best_plans(GstPad *pad, GstBuffer *buf, int number_of_focus, int latency, Gstmultifocus *multifocus);
 int find_best_plans(GstPad *pad, GstBuffer *buf, int *number_of_focus, int latency, Gstmultifocus *multifocus);
-static void gst_multifocus_finalize(void);
+static void gst_multifocus_finalize(GObject *object);
+static GstPad *gst_multifocus_request_new_pad(GstElement *element, GstPadTemplate *templ,
+                                              const gchar *name, const GstCaps *caps);
+static void gst_multifocus_release_pad(GstElement *element, GstPad *pad);
+static GstFlowReturn gst_multifocus_push(Gstmultifocus *multifocus, GstBuffer *buf, int plan, gboolean to_src);
+static void output_reset(Gstmultifocus *multifocus);
+static void gst_multifocus_trigger(Gstmultifocus *multifocus);
+static GstFlowReturn gst_multifocus_push_burst(Gstmultifocus *multifocus);
+static GstBuffer *fusion_end_dwell(Gstmultifocus *multifocus, gint width, gint height);
+static gboolean gst_multifocus_sink_event(GstPad *pad, GstObject *parent, GstEvent *event);
+static gboolean gst_multifocus_src_event(GstPad *pad, GstObject *parent, GstEvent *event);
+static void gst_multifocus_reset_qos(Gstmultifocus *multifocus);
+static gboolean gst_multifocus_is_late(Gstmultifocus *multifocus, GstBuffer *buf);
+static void start_sweep(GstPad *pad, GstBuffer *buf, Gstmultifocus *multifocus);
+static long int timed_sharpness(GstPad *pad, GstBuffer *buf, int decimation, Gstmultifocus *multifocus);
+static int sweep_sample(GstPad *pad, GstBuffer *buf, int pda, Gstmultifocus *multifocus);
+static void publish_depth_map(Gstmultifocus *multifocus);
+static void post_detection_message(Gstmultifocus *multifocus, const int *plans, int nb_plans, const int *sweep, int last);
+static void fill_skipped_samples(int *tab, int first, int last);
+static void command_lens(Gstmultifocus *multifocus, int plan, int pda);
+static void enter_plan(Gstmultifocus *multifocus, int plan, int pda, guint frames_since_command);
+static int sweep_latency(Gstmultifocus *multifocus);
+static gboolean calibration_step(GstPad *pad, GstBuffer *buf, Gstmultifocus *multifocus);
+static void record_sweep_peak(Gstmultifocus *multifocus, int last);
+static gboolean hysteresis_step(GstPad *pad, GstBuffer *buf, Gstmultifocus *multifocus);
+static void build_cycle(Gstmultifocus *multifocus);
+static void advance_cycle(Gstmultifocus *multifocus);
+static guint settle_frames(Gstmultifocus *multifocus, int from, int to);
+static gboolean ramp_begin(Gstmultifocus *multifocus, GstBuffer *buf);
+static void ramp_end(Gstmultifocus *multifocus);
+static void *ramp_thread(void *data);
+static int ramp_position(Gstmultifocus *multifocus, GstClockTime time);
+static GstClockTime ramp_lag(Gstmultifocus *multifocus);
+static GstClockTime mid_exposure_time(Gstmultifocus *multifocus, GstBuffer *buf);
+static gboolean ramp_sweep(GstPad *pad, GstBuffer *buf, int last, Gstmultifocus *multifocus);
+static void track_frame_duration(Gstmultifocus *multifocus, GstBuffer *buf);
+static void reset_dwell_clock(Gstmultifocus *multifocus);
+static gboolean dwell_over(Gstmultifocus *multifocus, GstBuffer *buf, guint ahead);
+static void parse_plan_weights(Gstmultifocus *multifocus);
+static void reset_plan_activity(Gstmultifocus *multifocus);
+static gdouble dwell_factor(Gstmultifocus *multifocus, int plan);
+static void schedule_dwell_end(Gstmultifocus *multifocus, GstBuffer *buf, int plan);
+static void measure_plan_activity(Gstmultifocus *multifocus, int plan, gint64 sharpness);
+static void detect_scene_change(Gstmultifocus *multifocus, GstBuffer *buf, int width, int height);
+static gboolean is_settled(Gstmultifocus *multifocus, GstBuffer *buf);
+static void track_dropped_frames(Gstmultifocus *multifocus, int step, int latency);
+static gboolean resample_step(GstPad *pad, GstBuffer *buf, int latency, Gstmultifocus *multifocus);
+static GstFlowReturn gst_multifocus_drop_frame(Gstmultifocus *multifocus, GstBuffer *buf, gboolean to_src);
+static gboolean gst_multifocus_control_event(Gstmultifocus *multifocus, GstEvent *event);
+static void go_to_plan(Gstmultifocus *multifocus, GstBuffer *buf, int plan);
 
 I2CDevice device;
 I2CDevice devicepda;
@@ -134,6 +222,80 @@ static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE("src",
                                                                   GST_PAD_ALWAYS,
                                                                   GST_STATIC_CAPS("ANY"));
 
+/* One request pad per plan, only the frames taken at that plan are pushed on it */
+static GstStaticPadTemplate plan_src_factory = GST_STATIC_PAD_TEMPLATE("src_%u",
+                                                                       GST_PAD_SRC,
+                                                                       GST_PAD_REQUEST,
+                                                                       GST_STATIC_CAPS("ANY"));
+
+GType gst_multifocus_transition_policy_get_type(void)
+{
+    static GType type = 0;
+    static const GEnumValue values[] = {
+        {TRANSITION_PASS, "Push the frames taken while the lens is settling", "pass"},
+        {TRANSITION_DROP, "Drop the frames taken while the lens is settling", "drop"},
+        {TRANSITION_MARK, "Flag the frames taken while the lens is settling as GAP and DROPPABLE", "mark"},
+        {0, NULL, NULL}
+    };
+
+    if (!type)
+    {
+        type = g_enum_register_static("GstMultifocusTransitionPolicy", values);
+    }
+    return type;
+}
+
+GType gst_multifocus_output_mode_get_type(void)
+{
+    static GType type = 0;
+    static const GEnumValue values[] = {
+        {OUTPUT_ALL, "Push every frame", "all"},
+        {OUTPUT_FUSED, "Push one all-in-focus frame per cycle of plans (GRAY8 only)", "fused"},
+        {OUTPUT_BEST, "Push the frame having the sharpest ROI of each cycle of plans", "best"},
+        {0, NULL, NULL}
+    };
+
+    if (!type)
+    {
+        type = g_enum_register_static("GstMultifocusOutputMode", values);
+    }
+    return type;
+}
+
+GType gst_multifocus_cycle_order_get_type(void)
+{
+    static GType type = 0;
+    static const GEnumValue values[] = {
+        {CYCLE_ARRAY, "The plans in the order of the \"plans\" property", "array"},
+        {CYCLE_SORTED, "The plans sorted by PDA", "sorted"},
+        {CYCLE_PING_PONG, "The plans sorted by PDA, up then down", "ping-pong"},
+        {CYCLE_CUSTOM, "The plan indices of the \"cycle-sequence\" property", "custom"},
+        {0, NULL, NULL}
+    };
+
+    if (!type)
+    {
+        type = g_enum_register_static("GstMultifocusCycleOrder", values);
+    }
+    return type;
+}
+
+GType gst_multifocus_sweep_mode_get_type(void)
+{
+    static GType type = 0;
+    static const GEnumValue values[] = {
+        {SWEEP_STEP, "One PDA command per frame", "step"},
+        {SWEEP_RAMP, "Continuous ramp, each frame is mapped to its mid-exposure PDA", "ramp"},
+        {0, NULL, NULL}
+    };
+
+    if (!type)
+    {
+        type = g_enum_register_static("GstMultifocusSweepMode", values);
+    }
+    return type;
+}
+
 #define gst_multifocus_parent_class parent_class
 G_DEFINE_TYPE(Gstmultifocus, gst_multifocus, GST_TYPE_ELEMENT)
 
@@ -143,6 +305,17 @@ static void gst_multifocus_get_property(GObject *object, guint prop_id,
                                         GValue *value, GParamSpec *pspec);
 
 static GstFlowReturn gst_multifocus_chain(GstPad *pad, GstObject *parent, GstBuffer *buf);
+static GstFlowReturn gst_multifocus_process(GstPad *pad, GstObject *parent, GstBuffer *buf, gint64 start);
+static void record_stage(Gstmultifocus *multifocus, multifocusStage stage, gint64 start);
+static long int stage_sharpness(Gstmultifocus *multifocus, GstPad *pad, GstBuffer *buf, int decimation);
+static void write_lens(Gstmultifocus *multifocus, int plan, int pda);
+static void register_tracer_records(void);
+static void trace_lens(Gstmultifocus *multifocus, const gchar *phase, int plan, int pda);
+static void trace_sweep(Gstmultifocus *multifocus, const gchar *phase, int pda, gint64 sharpness, int plans);
+static GstStructure *gst_multifocus_get_stats(Gstmultifocus *multifocus);
+static void dump_stats(Gstmultifocus *multifocus, const gchar *path);
+static void *stats_thread(void *data);
+static void stats_thread_stop(Gstmultifocus *multifocus);
 
 
 /* GObject vmethod implementations */
@@ -160,6 +333,19 @@ static void gst_multifocus_class_init(GstmultifocusClass *klass)
     gobject_class->get_property = gst_multifocus_get_property;
     gobject_class->finalize = gst_multifocus_finalize;
 
+    register_tracer_records();
+
+    gstelement_class->request_new_pad = GST_DEBUG_FUNCPTR(gst_multifocus_request_new_pad);
+    gstelement_class->release_pad = GST_DEBUG_FUNCPTR(gst_multifocus_release_pad);
+
+    klass->trigger = gst_multifocus_trigger;
+
+    /* Capture one settled frame on every plan as fast as the lens allows and
+     * push them together on the src pad as a buffer list */
+    gst_multifocus_signals[SIGNAL_TRIGGER] =
+        g_signal_new("trigger", G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+                     G_STRUCT_OFFSET(GstmultifocusClass, trigger), NULL, NULL, NULL, G_TYPE_NONE, 0);
+
     g_object_class_install_property(gobject_class, PROP_LATENCY,
                                     g_param_spec_int("latency", "Latency", "Latency between command and command effect on gstreamer",
                                                      1, 120, 3, G_PARAM_READWRITE));
@@ -194,6 +380,106 @@ static void gst_multifocus_class_init(GstmultifocusClass *klass)
                                                          "string containing the differents PDA of the plans",
 							"0;200;400;",
                                                          G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_ANALYSIS_BUDGET_US,
+                                    g_param_spec_int("analysis-budget-us", "Analysis budget",
+                                                     "Maximum time in microseconds spent computing the sharpness of a frame, the ROI is decimated to stay under it (0 = whole ROI)",
+                                                     0, 1000000, 0, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_TRANSITION_POLICY,
+                                    g_param_spec_enum("transition-policy", "Transition policy",
+                                                      "What to do with the frames taken during the \"latency\" frames following a plan switch",
+                                                      GST_TYPE_MULTIFOCUS_TRANSITION_POLICY, TRANSITION_PASS, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_DROPPED_FRAMES,
+                                    g_param_spec_uint("dropped-frames", "Dropped frames",
+                                                      "Number of frames dropped by the \"drop\" transition policy",
+                                                      0, G_MAXUINT, 0, G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_OUTPUT_MODE,
+                                    g_param_spec_enum("output-mode", "Output mode",
+                                                      "Frames pushed on the src pad, the src_%u pads always get every frame of their plan",
+                                                      GST_TYPE_MULTIFOCUS_OUTPUT_MODE, OUTPUT_ALL, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_FUSION_BLEND,
+                                    g_param_spec_boolean("fusion-blend", "Fusion blend",
+                                                         "In fused output mode, blend the planes weighted by their sharpness instead of picking the sharpest one",
+                                                         FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_DEPTH_MAP,
+                                    g_param_spec_boolean("depth-map", "Depth map",
+                                                         "Build a depth from focus map during the sweeps and attach it to the buffers",
+                                                         FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_DEPTH_TILE_SIZE,
+                                    g_param_spec_int("depth-tile-size", "Depth tile size",
+                                                     "Size in pixels of the square tiles of the depth map",
+                                                     DEPTH_MIN_TILE_SIZE, DEPTH_MAX_TILE_SIZE, 32, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_PREDICTIVE_SWITCH,
+                                    g_param_spec_boolean("predictive-switch", "Predictive switch",
+                                                         "Command the next plan \"latency\" frames before the end of the dwell so that its first frame is already settled",
+                                                         FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_CALIBRATE,
+                                    g_param_spec_boolean("calibrate", "Calibrate",
+                                                         "Measure the lens latency with a step of PDA, \"latency\" and \"lens-delay\" are updated when done",
+                                                         FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_LENS_DELAY,
+                                    g_param_spec_int("lens-delay", "Lens delay",
+                                                     "Measured frames between a command and its first effect, used to offset the sweeps (-1 = not calibrated, \"latency\" is used)",
+                                                     -1, 120, -1, G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_DIRECT_MOVES,
+                                    g_param_spec_boolean("direct-moves", "Direct moves",
+                                                         "Measure the hysteresis of the lens after each sweep and move straight to the corrected targets instead of approaching them from PDA 0",
+                                                         FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_HYSTERESIS_TOLERANCE,
+                                    g_param_spec_int("hysteresis-tolerance", "Hysteresis tolerance",
+                                                     "Largest predicted PDA error for a direct move",
+                                                     0, 100, 10, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_HYSTERESIS,
+                                    g_param_spec_int("hysteresis", "Hysteresis",
+                                                     "Measured PDA offset of a target approached from above",
+                                                     -1000, 1000, 0, G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_CYCLE_ORDER,
+                                    g_param_spec_enum("cycle-order", "Cycle order",
+                                                      "Order in which the plans are visited",
+                                                      GST_TYPE_MULTIFOCUS_CYCLE_ORDER, CYCLE_ARRAY, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_CYCLE_SEQUENCE,
+                                    g_param_spec_string("cycle-sequence", "Cycle sequence",
+                                                        "Plan indices visited by the custom cycle order, e.g. \"0;1;0;2;\"",
+                                                        "", G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_SWEEP_MODE,
+                                    g_param_spec_enum("sweep-mode", "Sweep mode",
+                                                      "How the lens goes over the range when searching the plans",
+                                                      GST_TYPE_MULTIFOCUS_SWEEP_MODE, SWEEP_STEP, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_RAMP_DURATION_MS,
+                                    g_param_spec_int("ramp-duration-ms", "Ramp duration",
+                                                     "Time in milliseconds taken by a ramp sweep to go over the range",
+                                                     50, 10000, 500, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_RAMP_LAG_MS,
+                                    g_param_spec_int("ramp-lag-ms", "Ramp lag",
+                                                     "Time in milliseconds between a ramp command and the lens showing it (-1 = the calibrated lens delay, 0 without calibration)",
+                                                     -1, 1000, -1, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_DWELL_TIME,
+                                    g_param_spec_uint64("dwell-time", "Dwell time",
+                                                        "Time spent on each plan in nanoseconds, measured on the buffer timestamps (0 = count \"space-between-switch\" frames)",
+                                                        0, G_MAXUINT64, 0, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_PLAN_WEIGHTS,
+                                    g_param_spec_string("plan-weights", "Plan weights",
+                                                        "Share of the dwell time of each plan, e.g. \"2;1;1;\" (missing weights are 1)",
+                                                        "", G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_ADAPTIVE_DWELL,
+                                    g_param_spec_boolean("adaptive-dwell", "Adaptive dwell",
+                                                         "Scale the plan weights with the recent ROI sharpness of each plan and how much it changes",
+                                                         FALSE, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_SCENE_CHANGE_THRESHOLD,
+                                    g_param_spec_int("scene-change-threshold", "Scene change threshold",
+                                                     "Mean grey level difference with the scene of the last detection that starts a new one (0 = disabled)",
+                                                     0, 255, 0, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_STATS,
+                                    g_param_spec_boxed("stats", "Stats",
+                                                       "Count, mean, p50, p99 and max in microseconds of the setup, sharpness, i2c, push and frame stages",
+                                                       GST_TYPE_STRUCTURE, G_PARAM_READABLE));
+    g_object_class_install_property(gobject_class, PROP_STATS_FILE,
+                                    g_param_spec_string("stats-file", "Stats file",
+                                                        "File the stats are periodically appended to, one line each time (NULL = none)",
+                                                        NULL, G_PARAM_READWRITE));
+    g_object_class_install_property(gobject_class, PROP_STATS_INTERVAL,
+                                    g_param_spec_uint("stats-interval", "Stats interval",
+                                                      "Milliseconds between two lines of the stats file",
+                                                      10, G_MAXUINT, 1000, G_PARAM_READWRITE));
     g_object_class_install_property(gobject_class, PROP_AUTO_DETECT_PLANS,
                                     g_param_spec_boolean("auto_detect_plans", "Auto_detect_plans",
                                                          "auto detection of plans",
@@ -216,6 +502,8 @@ static void gst_multifocus_class_init(GstmultifocusClass *klass)
 
     gst_element_class_add_pad_template(gstelement_class,
                                        gst_static_pad_template_get(&src_factory));
+    gst_element_class_add_pad_template(gstelement_class,
+                                       gst_static_pad_template_get(&plan_src_factory));
     gst_element_class_add_pad_template(gstelement_class,
                                        gst_static_pad_template_get(&sink_factory));
 }
@@ -230,10 +518,14 @@ static void gst_multifocus_init(Gstmultifocus *multifocus)
     multifocus->sinkpad = gst_pad_new_from_static_template(&sink_factory, "sink");
     gst_pad_set_chain_function(multifocus->sinkpad,
                                GST_DEBUG_FUNCPTR(gst_multifocus_chain));
+    gst_pad_set_event_function(multifocus->sinkpad,
+                               GST_DEBUG_FUNCPTR(gst_multifocus_sink_event));
     GST_PAD_SET_PROXY_CAPS(multifocus->sinkpad);
     gst_element_add_pad(GST_ELEMENT(multifocus), multifocus->sinkpad);
 
     multifocus->srcpad = gst_pad_new_from_static_template(&src_factory, "src");
+    gst_pad_set_event_function(multifocus->srcpad,
+                               GST_DEBUG_FUNCPTR(gst_multifocus_src_event));
     GST_PAD_SET_PROXY_CAPS(multifocus->srcpad);
     gst_element_add_pad(GST_ELEMENT(multifocus), multifocus->srcpad);
 
@@ -250,6 +542,127 @@ static void gst_multifocus_init(Gstmultifocus *multifocus)
     multifocus->reset = false;
     multifocus->auto_detect_plans = true;
     multifocus->plans= (char*)malloc(sizeof(char)*300);
+    gst_segment_init(&multifocus->segment, GST_FORMAT_UNDEFINED);
+    gst_multifocus_reset_qos(multifocus);
+    multifocus->sweep_decimation = 1;
+    multifocus->sweep_start_us = 0;
+    multifocus->last_sample_skipped = false;
+    multifocus->skipped_samples = 0;
+    multifocus->analysis_budget_us = 0;
+    multifocus->full_analysis_us = -1;
+    multifocus->frame_plan = -1;
+    multifocus->frame_pda = 0;
+    multifocus->frames_since_switch = 0;
+    multifocus->frame_sharpness = GST_MULTIFOCUS_SHARPNESS_NONE;
+    multifocus->transition_policy = TRANSITION_PASS;
+    multifocus->dropped_frames = 0;
+
+    for (int i = 0; i < MAX_PLANS; i++)
+    {
+        multifocus->plan_srcpads[i] = NULL;
+        multifocus->plan_srcpads_next[i] = GST_CLOCK_TIME_NONE;
+    }
+    multifocus->flow_combiner = gst_flow_combiner_new();
+    gst_flow_combiner_add_pad(multifocus->flow_combiner, multifocus->srcpad);
+
+    multifocus->output_mode = OUTPUT_ALL;
+    multifocus->fusion_blend = false;
+    multifocus->fusion_format_warned = false;
+    multifocus->fusion_pending = NULL;
+    multifocus->fusion_pending_plan = -1;
+    for (int i = 0; i < MAX_PLANS; i++)
+    {
+        multifocus->fusion_planes[i] = NULL;
+    }
+    multifocus->fusion_frame_size = 0;
+    multifocus->fusion_filled = 0;
+    multifocus->fusion_prev_pts = GST_CLOCK_TIME_NONE;
+    multifocus->best_pending = NULL;
+    multifocus->best_pending_sharpness = GST_MULTIFOCUS_SHARPNESS_NONE;
+
+    multifocus->trigger_pending = 0;
+    multifocus->burst_active = false;
+    multifocus->burst_plan = 0;
+    multifocus->burst_list = NULL;
+
+    multifocus->goto_plan = -1;
+    multifocus->redetect_pending = 0;
+    multifocus->cycle_paused = 0;
+
+    multifocus->predictive_switch = false;
+    multifocus->predicted_plan = -1;
+
+    multifocus->calibrating = false;
+    multifocus->calibration_step = 0;
+    multifocus->lens_delay = -1;
+
+    multifocus->sweep_peak = 0;
+    multifocus->hysteresis_active = false;
+    multifocus->hysteresis_step = 0;
+    multifocus->hysteresis_top = 0;
+
+    multifocus->cycle_order = CYCLE_ARRAY;
+    multifocus->cycle_sequence = g_strdup("");
+    multifocus->cycle_length = 0;
+    multifocus->cycle_position = 0;
+    multifocus->switch_settle = multifocus->latency;
+
+    multifocus->sweep_mode = SWEEP_STEP;
+    multifocus->ramp_duration_ms = 500;
+    multifocus->ramp_lag_ms = -1;
+    multifocus->sweep_ramp = false;
+    multifocus->ramp_stop = 0;
+    multifocus->ramp_clock = NULL;
+    multifocus->ramp_start = GST_CLOCK_TIME_NONE;
+    multifocus->ramp_from = 0;
+    multifocus->ramp_to = 0;
+
+    multifocus->dwell_time = 0;
+    multifocus->frame_duration = GST_CLOCK_TIME_NONE;
+    multifocus->last_pts = GST_CLOCK_TIME_NONE;
+    multifocus->current_pts = GST_CLOCK_TIME_NONE;
+    reset_dwell_clock(multifocus);
+
+    multifocus->plan_weights = g_strdup("");
+    parse_plan_weights(multifocus);
+    multifocus->adaptive_dwell = false;
+    reset_plan_activity(multifocus);
+    multifocus->dwell_measured = false;
+    multifocus->dwell_frames = multifocus->space_between_switch + 1;
+
+    multifocus->scene_change_threshold = 0;
+    multifocus->scene_reference_valid = false;
+    multifocus->scene_changed_frames = 0;
+
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        latencyReset(&multifocus->stage_stats[i]);
+    }
+    multifocus->stats_file = NULL;
+    multifocus->stats_interval = 1000;
+    multifocus->stats_running = false;
+    multifocus->stats_stop = false;
+    g_cond_init(&multifocus->stats_cond);
+    multifocus->settle_traced = true;
+
+    multifocus->last_offset = GST_BUFFER_OFFSET_NONE;
+    multifocus->missing_frames = 0;
+    multifocus->sweep_invalid_until = 0;
+    multifocus->resample_count = 0;
+    multifocus->resample_step = 0;
+    multifocus->resampling = false;
+
+    multifocus->depth_map = false;
+    multifocus->depth_tile_size = 32;
+    multifocus->depth_acc.bestEnergy = NULL;
+    multifocus->depth_acc.minEnergy = NULL;
+    multifocus->depth_acc.bestPda = NULL;
+    multifocus->depth_acc_active = false;
+    multifocus->depth = NULL;
+    multifocus->depth_confidence = NULL;
+    multifocus->depth_columns = 0;
+    multifocus->depth_rows = 0;
+    multifocus->depth_tile = 0;
     //multifocus->plans="0;200;400;";
     /*
     multifocus->plans = (GValue*)malloc(sizeof(GValue)*50);
@@ -325,6 +738,99 @@ static void gst_multifocus_set_property(GObject *object, guint prop_id,
     case PROP_PLANS:
 	copy(g_value_get_string(value),multifocus->plans);
         break;
+    case PROP_ANALYSIS_BUDGET_US:
+        multifocus->analysis_budget_us = g_value_get_int(value);
+        break;
+    case PROP_TRANSITION_POLICY:
+        multifocus->transition_policy = g_value_get_enum(value);
+        break;
+    case PROP_OUTPUT_MODE:
+        multifocus->output_mode = g_value_get_enum(value);
+        break;
+    case PROP_FUSION_BLEND:
+        multifocus->fusion_blend = g_value_get_boolean(value);
+        break;
+    case PROP_DEPTH_MAP:
+        multifocus->depth_map = g_value_get_boolean(value);
+        break;
+    case PROP_DEPTH_TILE_SIZE:
+        multifocus->depth_tile_size = g_value_get_int(value);
+        break;
+    case PROP_PREDICTIVE_SWITCH:
+        multifocus->predictive_switch = g_value_get_boolean(value);
+        break;
+    case PROP_CALIBRATE:
+        multifocus->calibration_step = 0;
+        multifocus->calibrating = g_value_get_boolean(value);
+        break;
+    case PROP_DIRECT_MOVES:
+        lensModel.directMoves = g_value_get_boolean(value);
+        break;
+    case PROP_HYSTERESIS_TOLERANCE:
+        lensModel.tolerance = g_value_get_int(value);
+        break;
+    case PROP_CYCLE_ORDER:
+        multifocus->cycle_order = g_value_get_enum(value);
+        multifocus->cycle_length = 0;
+        break;
+    case PROP_CYCLE_SEQUENCE:
+        g_free(multifocus->cycle_sequence);
+        multifocus->cycle_sequence = g_value_dup_string(value);
+        multifocus->cycle_length = 0;
+        break;
+    case PROP_SWEEP_MODE:
+        multifocus->sweep_mode = g_value_get_enum(value);
+        break;
+    case PROP_RAMP_DURATION_MS:
+        multifocus->ramp_duration_ms = g_value_get_int(value);
+        break;
+    case PROP_RAMP_LAG_MS:
+        multifocus->ramp_lag_ms = g_value_get_int(value);
+        break;
+    case PROP_DWELL_TIME:
+        multifocus->dwell_time = g_value_get_uint64(value);
+        break;
+    case PROP_PLAN_WEIGHTS:
+        g_free(multifocus->plan_weights);
+        multifocus->plan_weights = g_value_dup_string(value);
+        parse_plan_weights(multifocus);
+        break;
+    case PROP_ADAPTIVE_DWELL:
+        multifocus->adaptive_dwell = g_value_get_boolean(value);
+        break;
+    case PROP_SCENE_CHANGE_THRESHOLD:
+        multifocus->scene_change_threshold = g_value_get_int(value);
+        break;
+    case PROP_STATS_FILE:
+    {
+        gchar *path = g_value_dup_string(value);
+        gboolean start;
+
+        // Clearing the path stops the thread, the next path starts it again
+        if (path == NULL)
+            stats_thread_stop(multifocus);
+
+        // The stats thread may be reading the path
+        GST_OBJECT_LOCK(multifocus);
+        g_free(multifocus->stats_file);
+        multifocus->stats_file = path;
+        start = path != NULL && !multifocus->stats_running;
+        if (start)
+        {
+            multifocus->stats_running = true;
+            multifocus->stats_stop = false;
+        }
+        GST_OBJECT_UNLOCK(multifocus);
+
+        if (start)
+            pthread_create(&multifocus->stats_thread, NULL, stats_thread, multifocus);
+        break;
+    }
+    case PROP_STATS_INTERVAL:
+        GST_OBJECT_LOCK(multifocus);
+        multifocus->stats_interval = g_value_get_uint(value);
+        GST_OBJECT_UNLOCK(multifocus);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -377,6 +883,85 @@ static void gst_multifocus_get_property(GObject *object, guint prop_id,
     case PROP_PLANS:
         g_value_set_string(value, multifocus->plans);
         break;
+    case PROP_ANALYSIS_BUDGET_US:
+        g_value_set_int(value, multifocus->analysis_budget_us);
+        break;
+    case PROP_TRANSITION_POLICY:
+        g_value_set_enum(value, multifocus->transition_policy);
+        break;
+    case PROP_DROPPED_FRAMES:
+        g_value_set_uint(value, g_atomic_int_get((gint *)&multifocus->dropped_frames));
+        break;
+    case PROP_OUTPUT_MODE:
+        g_value_set_enum(value, multifocus->output_mode);
+        break;
+    case PROP_FUSION_BLEND:
+        g_value_set_boolean(value, multifocus->fusion_blend);
+        break;
+    case PROP_DEPTH_MAP:
+        g_value_set_boolean(value, multifocus->depth_map);
+        break;
+    case PROP_DEPTH_TILE_SIZE:
+        g_value_set_int(value, multifocus->depth_tile_size);
+        break;
+    case PROP_PREDICTIVE_SWITCH:
+        g_value_set_boolean(value, multifocus->predictive_switch);
+        break;
+    case PROP_CALIBRATE:
+        g_value_set_boolean(value, multifocus->calibrating);
+        break;
+    case PROP_LENS_DELAY:
+        g_value_set_int(value, multifocus->lens_delay);
+        break;
+    case PROP_DIRECT_MOVES:
+        g_value_set_boolean(value, lensModel.directMoves);
+        break;
+    case PROP_HYSTERESIS_TOLERANCE:
+        g_value_set_int(value, lensModel.tolerance);
+        break;
+    case PROP_HYSTERESIS:
+        g_value_set_int(value, lensModel.hysteresis);
+        break;
+    case PROP_CYCLE_ORDER:
+        g_value_set_enum(value, multifocus->cycle_order);
+        break;
+    case PROP_CYCLE_SEQUENCE:
+        g_value_set_string(value, multifocus->cycle_sequence);
+        break;
+    case PROP_SWEEP_MODE:
+        g_value_set_enum(value, multifocus->sweep_mode);
+        break;
+    case PROP_RAMP_DURATION_MS:
+        g_value_set_int(value, multifocus->ramp_duration_ms);
+        break;
+    case PROP_RAMP_LAG_MS:
+        g_value_set_int(value, multifocus->ramp_lag_ms);
+        break;
+    case PROP_DWELL_TIME:
+        g_value_set_uint64(value, multifocus->dwell_time);
+        break;
+    case PROP_PLAN_WEIGHTS:
+        g_value_set_string(value, multifocus->plan_weights);
+        break;
+    case PROP_ADAPTIVE_DWELL:
+        g_value_set_boolean(value, multifocus->adaptive_dwell);
+        break;
+    case PROP_SCENE_CHANGE_THRESHOLD:
+        g_value_set_int(value, multifocus->scene_change_threshold);
+        break;
+    case PROP_STATS:
+        g_value_take_boxed(value, gst_multifocus_get_stats(multifocus));
+        break;
+    case PROP_STATS_FILE:
+        GST_OBJECT_LOCK(multifocus);
+        g_value_set_string(value, multifocus->stats_file);
+        GST_OBJECT_UNLOCK(multifocus);
+        break;
+    case PROP_STATS_INTERVAL:
+        GST_OBJECT_LOCK(multifocus);
+        g_value_set_uint(value, multifocus->stats_interval);
+        GST_OBJECT_UNLOCK(multifocus);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -418,23 +1003,67 @@ int maximum_and_zero(int *tab, int *spot, int number_of_spot)
 
 int find_best_plan(GstPad *pad, GstBuffer *buf, int indice_next, Gstmultifocus *multifocus)
 {
-    if (step1 > multifocus->latency)
-    {
+    int latency = sweep_latency(multifocus);
 
-        sharpness_of_plans[step1 - multifocus->latency] = getSharpness(pad, buf, roi);
+    if (step1 == 0)
+    {
+        start_sweep(pad, buf, multifocus);
+    }
+    track_dropped_frames(multifocus, step1, latency);
+    if (multifocus->resampling)
+    {
+        if (!resample_step(pad, buf, latency, multifocus))
+            return 0;
+    }
+    else if (multifocus->sweep_ramp)
+    {
+        if (!ramp_sweep(pad, buf, 80 - latency, multifocus))
+        {
+            step1++;
+            return 0;
+        }
+        step1 = 80;
+    }
+    else if (step1 > latency)
+    {
+        if (step1 < multifocus->sweep_invalid_until)
+        {
+            multifocus->resample[multifocus->resample_count++] = step1 - latency;
+            sharpness_of_plans[step1 - latency] = SHARPNESS_SKIPPED;
+        }
+        else
+        {
+            sharpness_of_plans[step1 - latency] = sweep_sample(pad, buf, (step1 - latency - 9) * 10, multifocus);
+        }
     }
     // g_print("sharp : %d\n",sharpness_of_plans[frame-latency]);}
     if (step1 < 80)
     {
-        write_VdacPda(devicepda, bus, (step1-9)*10);
+        command_lens(multifocus, -1, (step1-9)*10);
         // g_print("frame : %d\n",frame);
     }
     else
     {
 
-        int ind = max_tab(sharpness_of_plans, 100);
+        int ind;
+        if (multifocus->resample_count > 0 && !multifocus->resampling)
+        {
+            multifocus->resampling = true;
+            multifocus->resample_step = 0;
+            multifocus->sweep_invalid_until = 0;
+            resample_step(pad, buf, latency, multifocus);
+            return 0;
+        }
+        fill_skipped_samples(sharpness_of_plans, 1, 80 - latency);
+        record_sweep_peak(multifocus, 80 - latency);
+        GST_DEBUG_OBJECT(multifocus, "sweep done, %u samples skipped, decimation %d",
+                         multifocus->skipped_samples, multifocus->sweep_decimation);
+        publish_depth_map(multifocus);
+        ind = max_tab(sharpness_of_plans, 100);
         plans_int[indice_next]=(ind-9) * 10;
-	printf("plans : %d , %d ,%d, %d\n",indice_next,plans_int[0],plans_int[1],plans_int[2]);
+	GST_DEBUG_OBJECT(multifocus, "plan %d found at PDA %d", indice_next, plans_int[indice_next]);
+	post_detection_message(multifocus, &plans_int[indice_next], 1, sharpness_of_plans, 80 - latency);
+	trace_sweep(multifocus, "end", plans_int[indice_next], sharpness_of_plans[ind], 1);
 	return 1;
     }
     step1++;
@@ -446,15 +1075,44 @@ int find_best_plan(GstPad *pad, GstBuffer *buf, int indice_next, Gstmultifocus *
 
 int find_best_plans(GstPad *pad, GstBuffer *buf, int *number_of_focus, int latency, Gstmultifocus *multifocus)
 {
-	if (step2 > latency && step2 < 80 + latency)
+	if (step2 == 0)
+	{
+		start_sweep(pad, buf, multifocus);
+	}
+	track_dropped_frames(multifocus, step2, latency);
+	if (multifocus->resampling)
+	{
+		if (!resample_step(pad, buf, latency, multifocus))
+			return 0;
+	}
+	else if (multifocus->sweep_ramp)
+	{
+		// The whole ramp stands for the steps of the sweep
+		if (!ramp_sweep(pad, buf, 80 - latency, multifocus))
+		{
+			step2++;
+			return 0;
+		}
+		step2 = 80;
+	}
+	else if (step2 > latency && step2 < 80 + latency)
     	{
-        	sharpness_of_plans[step2 - latency] = getSharpness(pad, buf, roi);
+		if (step2 < multifocus->sweep_invalid_until)
+		{
+			// Measured again once the sweep is over
+			multifocus->resample[multifocus->resample_count++] = step2 - latency;
+			sharpness_of_plans[step2 - latency] = SHARPNESS_SKIPPED;
+		}
+		else
+		{
+        		sharpness_of_plans[step2 - latency] = sweep_sample(pad, buf, (step2 - latency - 9) * 10, multifocus);
+		}
     	}
     
     // g_print("sharp : %d\n",sharpness_of_plans[step-latency]);}
     if (step2 < 80)
     {
-        write_VdacPda(devicepda, bus, (step2-9)*10);
+        command_lens(multifocus, -1, (step2-9)*10);
         // g_print("step : %d\n",step);
     }
     else
@@ -463,6 +1121,21 @@ int find_best_plans(GstPad *pad, GstBuffer *buf, int *number_of_focus, int laten
         int derivate[99];
 	int spot[50];
         int spot_number = 0;
+        int sweep[100];     // The samples before maximum_and_zero() marks the peaks it picks
+        if (multifocus->resample_count > 0 && !multifocus->resampling)
+        {
+            multifocus->resampling = true;
+            multifocus->resample_step = 0;
+            multifocus->sweep_invalid_until = 0;
+            resample_step(pad, buf, latency, multifocus);
+            return 0;
+        }
+        fill_skipped_samples(sharpness_of_plans, 1, 80 - latency);
+        record_sweep_peak(multifocus, 80 - latency);
+        GST_DEBUG_OBJECT(multifocus, "sweep done, %u samples skipped, decimation %d",
+                         multifocus->skipped_samples, multifocus->sweep_decimation);
+        publish_depth_map(multifocus);
+        memcpy(sweep, sharpness_of_plans, sizeof(sweep));
         for (int i = 0; i < 99; i++)
         {
             derivate[i] = sharpness_of_plans[i + 1] - sharpness_of_plans[i];
@@ -481,12 +1154,8 @@ int find_best_plans(GstPad *pad, GstBuffer *buf, int *number_of_focus, int laten
             for (int i = 0; i < spot_number; i++)
             {
                 plans_int[i] = (spot[i]-9) * 10;
-       		g_print(" best plans :%d", plans_int[i]);
             }
 	    	*number_of_focus = spot_number;
-		
-		g_print("\n");
-
         }
         else
         {
@@ -496,11 +1165,11 @@ int find_best_plans(GstPad *pad, GstBuffer *buf, int *number_of_focus, int laten
 
                 int indice = maximum_and_zero(sharpness_of_plans, spot, spot_number);
 		plans_int[i]=(indice-9) * 10;
-       		g_print(" best plans :%d", plans_int[i]);
             }
-       	    g_print("\n");
-
         }
+	GST_DEBUG_OBJECT(multifocus, "%d plans found", *number_of_focus);
+	post_detection_message(multifocus, plans_int, *number_of_focus, sweep, 80 - latency);
+	trace_sweep(multifocus, "end", (*number_of_focus > 0) ? plans_int[0] : -1, 0, *number_of_focus);
 	return 1;
     }
     step2++;
@@ -508,105 +1177,1906 @@ int find_best_plans(GstPad *pad, GstBuffer *buf, int *number_of_focus, int laten
 }
 
 
-void constructString(char* string, int *tab,int size)
+/* Post the result of a sweep on the bus as a "multifocus-detection" element
+ * message: the PDA of the plans found, the confidence of each peak (its
+ * height above the lowest sample relative to the peak), the whole sharpness
+ * curve of the sweep and the time it took. The sweep samples have to be
+ * given as they were before the peaks were picked.
+ */
+static void post_detection_message(Gstmultifocus *multifocus, const int *plans, int nb_plans, const int *sweep, int last)
 {
-	string[0]=0;
-	for(int i=0;i<size;i++)
-	{
-		int err;
-		err = sprintf(string,"%s%d;",string,tab[i]);
-		if(err == -1)
-		{
-			return;
-		}
-		printf("string : %s\n",string);
-	}
+    GValue plan_values = G_VALUE_INIT;
+    GValue confidences = G_VALUE_INIT;
+    GValue curve = G_VALUE_INIT;
+    GstStructure *s;
+    int lowest = G_MAXINT;
+
+    for (int i = 1; i <= last; i++)
+    {
+        lowest = MIN(lowest, sweep[i]);
+    }
+
+    g_value_init(&plan_values, GST_TYPE_ARRAY);
+    g_value_init(&confidences, GST_TYPE_ARRAY);
+    g_value_init(&curve, GST_TYPE_ARRAY);
+
+    for (int i = 0; i < nb_plans; i++)
+    {
+        GValue value = G_VALUE_INIT;
+        int peak = sweep[CLAMP(plans[i] / 10 + 9, 0, 99)];
+
+        g_value_init(&value, G_TYPE_INT);
+        g_value_set_int(&value, plans[i]);
+        gst_value_array_append_and_take_value(&plan_values, &value);
+
+        g_value_init(&value, G_TYPE_DOUBLE);
+        g_value_set_double(&value, (peak > 0) ? (gdouble)(peak - lowest) / peak : 0);
+        gst_value_array_append_and_take_value(&confidences, &value);
+    }
+
+    for (int i = 1; i <= last; i++)
+    {
+        GValue value = G_VALUE_INIT;
+
+        g_value_init(&value, G_TYPE_INT);
+        g_value_set_int(&value, sweep[i]);
+        gst_value_array_append_and_take_value(&curve, &value);
+    }
+
+    s = gst_structure_new("multifocus-detection",
+                          "sweep-first-pda", G_TYPE_INT, (1 - 9) * 10,
+                          "sweep-pda-step", G_TYPE_INT, 10,
+                          "decimation", G_TYPE_INT, multifocus->sweep_decimation,
+                          "duration", G_TYPE_UINT64, (guint64)(g_get_monotonic_time() - multifocus->sweep_start_us) * GST_USECOND,
+                          NULL);
+    gst_structure_take_value(s, "plans", &plan_values);
+    gst_structure_take_value(s, "confidence", &confidences);
+    gst_structure_take_value(s, "sweep", &curve);
+
+    gst_element_post_message(GST_ELEMENT(multifocus), gst_message_new_element(GST_OBJECT(multifocus), s));
 }
-void parseString(char* string, int *tab,int size)
+
+/* Choose the sampling density of a new sweep: the ROI is decimated when
+ * downstream can't keep up or when a full analysis would exceed the
+ * analysis budget. The density is never changed in the middle of a sweep so
+ * that the samples stay comparable.
+ */
+static void start_sweep(GstPad *pad, GstBuffer *buf, Gstmultifocus *multifocus)
 {
+    gdouble proportion;
+    int qos_decimation = 1;
+    int budget_decimation = 1;
 
-	for(int i=0;i<size;i++)
-	{
-		int size_of_number;
-		char tmp[10];
-		size_of_number = sscanf(string,"%d;",&(tab[i]));
-		if(size_of_number<0)
-			return;
+    GST_OBJECT_LOCK(multifocus);
+    proportion = multifocus->qos_proportion;
+    GST_OBJECT_UNLOCK(multifocus);
 
-		snprintf(tmp,10,"%d",tab[i]);
-		string+=strlen(tmp)+1;
-		//printf("tab[%d] : %d\n",i,tab[i]);
+    while (qos_decimation < MAX_DECIMATION && qos_decimation < proportion)
+    {
+        qos_decimation *= 2;
+    }
 
-	}
+    if (multifocus->analysis_budget_us > 0)
+    {
+        if (multifocus->full_analysis_us < 0)
+        {
+            // Nothing measured yet, probe the cost of the kernel on this frame
+            timed_sharpness(pad, buf, 1, multifocus);
+        }
+
+        // The cost of the kernel decreases with the square of the decimation
+        while (budget_decimation < MAX_DECIMATION &&
+               multifocus->full_analysis_us / (budget_decimation * budget_decimation) > multifocus->analysis_budget_us)
+        {
+            budget_decimation *= 2;
+        }
+    }
+
+    multifocus->sweep_decimation = MAX(qos_decimation, budget_decimation);
+    multifocus->sweep_start_us = g_get_monotonic_time();
+    trace_sweep(multifocus, "start", 0, 0, 0);
+    multifocus->last_sample_skipped = false;
+    multifocus->skipped_samples = 0;
+    multifocus->sweep_ramp = multifocus->sweep_mode == SWEEP_RAMP && ramp_begin(multifocus, buf);
+    multifocus->sweep_invalid_until = 0;
+    multifocus->resample_count = 0;
+    multifocus->resampling = false;
+
+    if (multifocus->depth_acc_active)
+    {
+        depthMapFree(&multifocus->depth_acc);
+        multifocus->depth_acc_active = false;
+    }
+    if (multifocus->depth_map)
+    {
+        GstCaps *caps = gst_pad_get_current_caps(pad);
+        GstVideoInfo info;
+
+        // The map is measured on the luma of GRAY8 frames only
+        if (caps != NULL && gst_video_info_from_caps(&info, caps) &&
+            GST_VIDEO_INFO_FORMAT(&info) == GST_VIDEO_FORMAT_GRAY8)
+        {
+            multifocus->depth_stride = GST_VIDEO_INFO_PLANE_STRIDE(&info, 0);
+            multifocus->depth_acc_active = depthMapInit(&multifocus->depth_acc, GST_VIDEO_INFO_WIDTH(&info),
+                                                        GST_VIDEO_INFO_HEIGHT(&info), multifocus->depth_tile_size) == 0;
+        }
+        else
+        {
+            GST_WARNING_OBJECT(multifocus, "depth-map needs GRAY8 frames, no map for this sweep");
+        }
+        if (caps != NULL)
+            gst_caps_unref(caps);
+    }
+
+    if (multifocus->sweep_decimation > 1)
+    {
+        GST_INFO_OBJECT(multifocus, "sweep sharpness decimated by %d (QoS proportion %f, full analysis %" G_GINT64_FORMAT " us, budget %d us)",
+                        multifocus->sweep_decimation, proportion, multifocus->full_analysis_us, multifocus->analysis_budget_us);
+    }
 }
 
-void check_ROI_with_frame(gint *width,gint *height, ROI *roi)
+static void record_stage(Gstmultifocus *multifocus, multifocusStage stage, gint64 start)
 {
+    gint64 elapsed = g_get_monotonic_time() - start;
 
-            	if(roi->height>*height)
-            	{
-            		roi->height=*height-roi->y;
-            	}
-            
-            	if(roi->width>*width)
-            	{
-            		roi->width=*width-roi->x;
-            	}
+    latencyRecord(&multifocus->stage_stats[stage], MAX(elapsed, 0));
 }
 
+/* Sharpness of the ROI of the frame, timed as the sharpness stage */
+static long int stage_sharpness(Gstmultifocus *multifocus, GstPad *pad, GstBuffer *buf, int decimation)
+{
+    gint64 start = g_get_monotonic_time();
+    long int sharpness = getSharpness(pad, buf, roi, decimation);
+
+    record_stage(multifocus, STAGE_SHARPNESS, start);
 
-/* chain function
- * this function does the actual processing
+    return sharpness;
+}
+
+/* PDA command through the lens model, timed as the i2c stage. A ramp still
+ * running is stopped first, its thread is the only other writer of the lens.
  */
+static void write_lens(Gstmultifocus *multifocus, int plan, int pda)
+{
+    gint64 start;
+
+    ramp_end(multifocus);
+    start = g_get_monotonic_time();
+    trace_lens(multifocus, "issued", plan, pda);
+    moveLens(&devicepda, bus, &lensModel, pda);
+    record_stage(multifocus, STAGE_I2C, start);
+    trace_lens(multifocus, "written", plan, pda);
+}
 
+static GstStructure *tracer_field(GType type, const gchar *description)
+{
+    return gst_structure_new("value",
+                             "type", G_TYPE_GTYPE, type,
+                             "description", G_TYPE_STRING, description,
+                             "flags", GST_TYPE_TRACER_VALUE_FLAGS, GST_TRACER_VALUE_FLAGS_NONE,
+                             NULL);
+}
 
+static void register_tracer_records(void)
+{
+    GstStructure *element = gst_structure_new("scope",
+                                              "type", G_TYPE_GTYPE, G_TYPE_STRING,
+                                              "related-to", GST_TYPE_TRACER_VALUE_SCOPE, GST_TRACER_VALUE_SCOPE_ELEMENT,
+                                              NULL);
+
+    tracer_lens = gst_tracer_record_new("multifocus-lens.class",
+                                        "element", gst_structure_copy(element),
+                                        "ts", tracer_field(G_TYPE_UINT64, "time of the event"),
+                                        "phase", tracer_field(G_TYPE_STRING, "issued, written or settled"),
+                                        "plan", tracer_field(G_TYPE_INT, "plan of the command, -1 outside of the plans"),
+                                        "pda", tracer_field(G_TYPE_INT, "PDA of the command"),
+                                        NULL);
+    tracer_sweep = gst_tracer_record_new("multifocus-sweep.class",
+                                         "element", element,
+                                         "ts", tracer_field(G_TYPE_UINT64, "time of the event"),
+                                         "phase", tracer_field(G_TYPE_STRING, "start, sample or end"),
+                                         "pda", tracer_field(G_TYPE_INT, "PDA of the sample, of the first plan found at the end"),
+                                         "sharpness", tracer_field(G_TYPE_INT64, "sharpness of the sample"),
+                                         "plans", tracer_field(G_TYPE_INT, "number of plans found at the end"),
+                                         NULL);
+}
 
+static void trace_lens(Gstmultifocus *multifocus, const gchar *phase, int plan, int pda)
+{
+    gst_tracer_record_log(tracer_lens, GST_OBJECT_NAME(multifocus), gst_util_get_timestamp(), phase, plan, pda);
+}
 
+static void trace_sweep(Gstmultifocus *multifocus, const gchar *phase, int pda, gint64 sharpness, int plans)
+{
+    gst_tracer_record_log(tracer_sweep, GST_OBJECT_NAME(multifocus), gst_util_get_timestamp(), phase, pda, sharpness, plans);
+}
 
-static GstFlowReturn gst_multifocus_chain(GstPad *pad, GstObject *parent, GstBuffer *buf)
+static GstStructure *gst_multifocus_get_stats(Gstmultifocus *multifocus)
 {
-    Gstmultifocus *multifocus = GST_multifocus(parent);
-    GstCaps *caps = gst_pad_get_current_caps(pad);
-    GstStructure *s = gst_caps_get_structure(caps,0);
+    static const gchar *names[STAGE_COUNT] = { "setup", "sharpness", "i2c", "push", "frame" };
+    GstStructure *s = gst_structure_new_empty("multifocus-stats");
 
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        const LatencyHistogram *h = &multifocus->stage_stats[i];
+        guint64 count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        guint64 total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+        gchar *count_name = g_strdup_printf("%s-count", names[i]);
+        gchar *mean_name = g_strdup_printf("%s-mean", names[i]);
+        gchar *p50_name = g_strdup_printf("%s-p50", names[i]);
+        gchar *p99_name = g_strdup_printf("%s-p99", names[i]);
+        gchar *max_name = g_strdup_printf("%s-max", names[i]);
+
+        gst_structure_set(s,
+                          count_name, G_TYPE_UINT64, count,
+                          mean_name, G_TYPE_UINT64, (count > 0) ? total / count : 0,
+                          p50_name, G_TYPE_UINT64, (guint64)latencyPercentile(h, 50),
+                          p99_name, G_TYPE_UINT64, (guint64)latencyPercentile(h, 99),
+                          max_name, G_TYPE_UINT64, (guint64)__atomic_load_n(&h->max, __ATOMIC_RELAXED),
+                          NULL);
+
+        g_free(count_name);
+        g_free(mean_name);
+        g_free(p50_name);
+        g_free(p99_name);
+        g_free(max_name);
+    }
 
-	
-	if(!i2c_err && multifocus->work)
-	{
-		gint width=0,height=0;
-            
-            
-            	gst_structure_get_int(s,"width", &width);
-            	gst_structure_get_int(s,"height", &height);
-            	roi.x = multifocus->ROI1x;
-            	roi.y = multifocus->ROI1y;
-            	roi.height = multifocus->ROI2y - multifocus->ROI1y;
-            	roi.width = multifocus->ROI2x - multifocus->ROI1x;
-		check_ROI_with_frame(&width,&height,&roi);
+    return s;
+}
 
-		if(multifocus->reset)
-		{
-			int done=0;
-			if(multifocus->auto_detect_plans)
-			{
-				if(multifocus->wait_after_start < frame)
-				{
+/* Append a line of stats to the stats file */
+static void dump_stats(Gstmultifocus *multifocus, const gchar *path)
+{
+    GstStructure *stats;
+    gchar *line;
+    FILE *file;
 
-					done = find_best_plans(pad, buf, &(multifocus->number_of_plans), multifocus->latency, multifocus);
-					g_print("number of focus %d \n",multifocus->number_of_plans);
+    file = fopen(path, "a");
+    if (file == NULL)
+    {
+        GST_WARNING_OBJECT(multifocus, "can't open the stats file %s", path);
+        return;
+    }
 
-				}
-				if(done)
-				{
-					constructString(multifocus->plans, plans_int,multifocus->number_of_plans);
-					multifocus->reset=false;
-					multifocus->next=false;
-					step1=0;
-					step2=0;
-					indice_next=0;
-				}
-			
-			}
+    stats = gst_multifocus_get_stats(multifocus);
+    line = gst_structure_to_string(stats);
+    fprintf(file, "%" G_GINT64_FORMAT " %s\n", g_get_monotonic_time(), line);
+    fclose(file);
+
+    g_free(line);
+    gst_structure_free(stats);
+}
+
+/* Dump the stats every "stats-interval" milliseconds, so that the file
+ * accesses don't add to the time of the frames they measure.
+ */
+static void *stats_thread(void *data)
+{
+    Gstmultifocus *multifocus = (Gstmultifocus *)data;
+
+    GST_OBJECT_LOCK(multifocus);
+    while (!multifocus->stats_stop)
+    {
+        gint64 wake = g_get_monotonic_time() + (gint64)multifocus->stats_interval * 1000;
+        gchar *path;
+
+        while (!multifocus->stats_stop && g_get_monotonic_time() < wake)
+        {
+            g_cond_wait_until(&multifocus->stats_cond, GST_OBJECT_GET_LOCK(multifocus), wake);
+        }
+        if (multifocus->stats_stop)
+            break;
+
+        path = g_strdup(multifocus->stats_file);
+        GST_OBJECT_UNLOCK(multifocus);
+
+        if (path != NULL)
+            dump_stats(multifocus, path);
+        g_free(path);
+
+        GST_OBJECT_LOCK(multifocus);
+    }
+    GST_OBJECT_UNLOCK(multifocus);
+
+    return NULL;
+}
+
+static void stats_thread_stop(Gstmultifocus *multifocus)
+{
+    if (!multifocus->stats_running)
+        return;
+
+    GST_OBJECT_LOCK(multifocus);
+    multifocus->stats_stop = true;
+    g_cond_signal(&multifocus->stats_cond);
+    GST_OBJECT_UNLOCK(multifocus);
+
+    pthread_join(multifocus->stats_thread, NULL);
+    multifocus->stats_running = false;
+}
+
+/* Compute the sharpness and keep track of the time the kernel would take on
+ * the whole ROI.
+ */
+static long int timed_sharpness(GstPad *pad, GstBuffer *buf, int decimation, Gstmultifocus *multifocus)
+{
+    gint64 start = g_get_monotonic_time();
+    long int sharpness = stage_sharpness(multifocus, pad, buf, decimation);
+    gint64 full_us = (g_get_monotonic_time() - start) * decimation * decimation;
+
+    if (multifocus->full_analysis_us < 0)
+        multifocus->full_analysis_us = full_us;
+    else
+        multifocus->full_analysis_us = (3 * multifocus->full_analysis_us + full_us) / 4;
+
+    return sharpness;
+}
+
+/* Measure one sample of the sweep. When the buffer is already late the
+ * sample is skipped and marked, never twice in a row so that every skipped
+ * sample can be interpolated from its neighbours.
+ */
+static int sweep_sample(GstPad *pad, GstBuffer *buf, int pda, Gstmultifocus *multifocus)
+{
+    if (!multifocus->last_sample_skipped && gst_multifocus_is_late(multifocus, buf))
+    {
+        GST_DEBUG_OBJECT(multifocus, "buffer %" GST_TIME_FORMAT " is late, skipping sweep sample",
+                         GST_TIME_ARGS(GST_BUFFER_PTS(buf)));
+        multifocus->last_sample_skipped = true;
+        multifocus->skipped_samples++;
+        return SHARPNESS_SKIPPED;
+    }
+
+    multifocus->last_sample_skipped = false;
+    multifocus->frame_sharpness = timed_sharpness(pad, buf, multifocus->sweep_decimation, multifocus);
+    trace_sweep(multifocus, "sample", pda, multifocus->frame_sharpness, 0);
+
+    if (multifocus->depth_acc_active)
+    {
+        GstMapInfo map;
+
+        if (gst_buffer_map(buf, &map, GST_MAP_READ))
+        {
+            if (map.size >= (gsize)multifocus->depth_stride * multifocus->depth_acc.height)
+                depthMapAddSample(&multifocus->depth_acc, map.data, multifocus->depth_stride, pda,
+                                  multifocus->sweep_decimation);
+            gst_buffer_unmap(buf, &map);
+        }
+    }
+
+    return multifocus->frame_sharpness;
+}
+
+/* Turn the depth map accumulated during the sweep into the one attached to
+ * the buffers. The previous map is kept if nothing was accumulated.
+ */
+static void publish_depth_map(Gstmultifocus *multifocus)
+{
+    GstMapInfo depth_map, confidence_map;
+    gsize tiles;
+
+    if (!multifocus->depth_acc_active)
+        return;
+
+    if (multifocus->depth_acc.samples > 0)
+    {
+        tiles = (gsize)multifocus->depth_acc.columns * multifocus->depth_acc.rows;
+
+        gst_buffer_replace(&multifocus->depth, NULL);
+        gst_buffer_replace(&multifocus->depth_confidence, NULL);
+        multifocus->depth = gst_buffer_new_allocate(NULL, tiles * sizeof(gint16), NULL);
+        multifocus->depth_confidence = gst_buffer_new_allocate(NULL, tiles, NULL);
+
+        gst_buffer_map(multifocus->depth, &depth_map, GST_MAP_WRITE);
+        gst_buffer_map(multifocus->depth_confidence, &confidence_map, GST_MAP_WRITE);
+        depthMapExport(&multifocus->depth_acc, (short *)depth_map.data, confidence_map.data);
+        gst_buffer_unmap(multifocus->depth_confidence, &confidence_map);
+        gst_buffer_unmap(multifocus->depth, &depth_map);
+
+        multifocus->depth_columns = multifocus->depth_acc.columns;
+        multifocus->depth_rows = multifocus->depth_acc.rows;
+        multifocus->depth_tile = multifocus->depth_acc.tileSize;
+
+        GST_DEBUG_OBJECT(multifocus, "depth map of %ux%u tiles built from %d frames",
+                         multifocus->depth_columns, multifocus->depth_rows, multifocus->depth_acc.samples);
+    }
+
+    depthMapFree(&multifocus->depth_acc);
+    multifocus->depth_acc_active = false;
+}
+
+/* Send a PDA command to the lens and restart the count of frames taken since
+ * the last switch, plan is -1 when the command isn't one of the plans.
+ */
+static void command_lens(Gstmultifocus *multifocus, int plan, int pda)
+{
+    write_lens(multifocus, plan, pda);
+    enter_plan(multifocus, plan, pda, 0);
+}
+
+/* Label the following frames with a plan whose command was sent
+ * frames_since_command frames ago.
+ */
+static void enter_plan(Gstmultifocus *multifocus, int plan, int pda, guint frames_since_command)
+{
+    multifocus->switch_settle = settle_frames(multifocus, multifocus->frame_pda, pda);
+    multifocus->switch_pts = multifocus->current_pts;
+    if (GST_CLOCK_TIME_IS_VALID(multifocus->current_pts) && GST_CLOCK_TIME_IS_VALID(multifocus->frame_duration))
+        multifocus->switch_pts -= MIN(frames_since_command * multifocus->frame_duration, multifocus->current_pts);
+    multifocus->frame_plan = plan;
+    multifocus->frame_pda = pda;
+    multifocus->frames_since_switch = frames_since_command;
+    multifocus->settle_traced = false;
+}
+
+/* Number of frames between a sweep command and the frame showing it. The
+ * sweep steps are small so the calibrated delay is used rather than the
+ * settling time when it is known.
+ */
+static int sweep_latency(Gstmultifocus *multifocus)
+{
+    return (multifocus->lens_delay > 0) ? multifocus->lens_delay : multifocus->latency;
+}
+
+/* Step the lens between two PDAs and watch the sharpness of the ROI to
+ * measure the delay before a command shows and the time the lens takes to
+ * settle. Returns TRUE once the calibration is over.
+ */
+static gboolean calibration_step(GstPad *pad, GstBuffer *buf, Gstmultifocus *multifocus)
+{
+    int step = multifocus->calibration_step++;
+    long int sharpness = stage_sharpness(multifocus, pad, buf, 1);
+    int delay, settle;
+
+    multifocus->frame_sharpness = sharpness;
+
+    if (step == 0)
+    {
+        // Step from a plan to a clearly different PDA so that the sharpness changes
+        int from = (multifocus->number_of_plans > 0) ? plans_int[0] : 0;
+
+        multifocus->calibration_pda[0] = from;
+        multifocus->calibration_pda[1] = (from < 300) ? from + 400 : from - 400;
+        multifocus->calibration_before = 0;
+        command_lens(multifocus, -1, multifocus->calibration_pda[0]);
+        return false;
+    }
+
+    if (step < CALIBRATION_HOLD)
+    {
+        if (step >= CALIBRATION_HOLD - 5)
+            multifocus->calibration_before += sharpness;
+        return false;
+    }
+
+    if (step == CALIBRATION_HOLD)
+    {
+        multifocus->calibration_before /= 5;
+        command_lens(multifocus, -1, multifocus->calibration_pda[1]);
+    }
+
+    multifocus->calibration_samples[step - CALIBRATION_HOLD] = sharpness;
+    if (step - CALIBRATION_HOLD < CALIBRATION_WINDOW - 1)
+        return false;
+
+    if (measureLensResponse(multifocus->calibration_samples, CALIBRATION_WINDOW,
+                            multifocus->calibration_before, &delay, &settle) != 0)
+    {
+        GST_WARNING_OBJECT(multifocus, "lens calibration failed, the sharpness didn't change between PDA %d and %d",
+                           multifocus->calibration_pda[0], multifocus->calibration_pda[1]);
+        return true;
+    }
+
+    multifocus->lens_delay = CLAMP(delay, 1, 120);
+    multifocus->latency = CLAMP(settle, multifocus->lens_delay, 120);
+
+    GST_INFO_OBJECT(multifocus, "lens calibrated: delay %d frames, settled after %d frames",
+                    multifocus->lens_delay, multifocus->latency);
+    return true;
+}
+
+/* Locate the peak of the sweep which just ended, in between the samples.
+ * The sweeps approach every PDA from below, with direct moves a descending
+ * pass around that peak follows to measure the hysteresis, as long as the
+ * model doesn't predict the moves within the tolerance.
+ */
+static void record_sweep_peak(Gstmultifocus *multifocus, int last)
+{
+    int ind = 1;
+    float offset = 0;
+
+    for (int i = 2; i <= last; i++)
+    {
+        if (sharpness_of_plans[i] > sharpness_of_plans[ind])
+            ind = i;
+    }
+    if (ind > 1 && ind < last)
+        offset = refinePeak(sharpness_of_plans[ind - 1], sharpness_of_plans[ind], sharpness_of_plans[ind + 1]);
+
+    multifocus->sweep_peak = (ind + offset - 9) * 10;
+
+    if (lensModel.directMoves && (lensModel.uncertainty < 0 || lensModel.uncertainty > lensModel.tolerance))
+    {
+        multifocus->hysteresis_active = true;
+        multifocus->hysteresis_step = 0;
+    }
+}
+
+/* One frame of the descending pass: the lens goes down 10 PDA per frame
+ * across the peak of the sweep and the position of the peak seen from above
+ * gives the hysteresis. Returns TRUE once the pass is over.
+ */
+static gboolean hysteresis_step(GstPad *pad, GstBuffer *buf, Gstmultifocus *multifocus)
+{
+    int step = multifocus->hysteresis_step++;
+    int sample = step - sweep_latency(multifocus);
+    int pda;
+    int ind = 0;
+    float offset = 0;
+    float peak_from_above;  // Relative to the peak seen from below
+
+    if (step == 0)
+    {
+        // Start above the pass so that every sample is approached from above
+        multifocus->hysteresis_top = ((int)(multifocus->sweep_peak / 10) + HYSTERESIS_STEPS / 2) * 10;
+    }
+    if (step <= HYSTERESIS_STEPS)
+    {
+        // Raw commands, the model is what is being measured
+        gint64 start;
+
+        ramp_end(multifocus);
+        start = g_get_monotonic_time();
+        pda = multifocus->hysteresis_top + 10 - step * 10;
+        trace_lens(multifocus, "issued", -1, pda);
+        write_VdacPda(devicepda, bus, pda);
+        record_stage(multifocus, STAGE_I2C, start);
+        trace_lens(multifocus, "written", -1, pda);
+        lensModel.lastPda = pda;
+        lensModel.lastPdaKnown = true;
+        enter_plan(multifocus, -1, pda, 0);
+    }
+
+    if (sample >= 1 && sample <= HYSTERESIS_STEPS)
+    {
+        multifocus->frame_sharpness = stage_sharpness(multifocus, pad, buf, multifocus->sweep_decimation);
+        multifocus->hysteresis_samples[sample - 1] = multifocus->frame_sharpness;
+    }
+    if (sample < HYSTERESIS_STEPS)
+        return false;
+
+    for (int i = 1; i < HYSTERESIS_STEPS; i++)
+    {
+        if (multifocus->hysteresis_samples[i] > multifocus->hysteresis_samples[ind])
+            ind = i;
+    }
+    if (ind > 0 && ind < HYSTERESIS_STEPS - 1)
+        offset = refinePeak(multifocus->hysteresis_samples[ind - 1], multifocus->hysteresis_samples[ind],
+                            multifocus->hysteresis_samples[ind + 1]);
+
+    // The samples go down in PDA
+    peak_from_above = multifocus->hysteresis_top - (ind + offset) * 10 - multifocus->sweep_peak;
+    updateLensModel(&lensModel, (int)(peak_from_above + ((peak_from_above >= 0) ? 0.5f : -0.5f)));
+
+    GST_INFO_OBJECT(multifocus, "lens hysteresis %d PDA (predicted error %d)", lensModel.hysteresis, lensModel.uncertainty);
+    return true;
+}
+
+/* Frames needed before a move from one PDA to another is settled: the
+ * command delay plus a share of the settling time proportional to the
+ * distance, "latency" being the settling time of the longest move between
+ * the plans. Without a calibrated delay nothing tells the delay from the
+ * settling time, so every move takes "latency" rather than guessing a
+ * delay that could mark moving frames as settled.
+ */
+static guint settle_frames(Gstmultifocus *multifocus, int from, int to)
+{
+    int delay = sweep_latency(multifocus);
+    int lowest = plans_int[0];
+    int highest = plans_int[0];
+    int span, distance;
+
+    if (delay >= multifocus->latency)
+        return multifocus->latency;
+
+    for (int i = 1; i < multifocus->number_of_plans && i < MAX_PLANS; i++)
+    {
+        lowest = MIN(lowest, plans_int[i]);
+        highest = MAX(highest, plans_int[i]);
+    }
+    span = highest - lowest;
+    distance = MIN(abs(to - from), span);
+    if (span <= 0)
+        return multifocus->latency;
+
+    return delay + ((multifocus->latency - delay) * distance + span - 1) / span;
+}
+
+/* Fill the cycle with the plans in the order they are visited */
+static void build_cycle(Gstmultifocus *multifocus)
+{
+    int nb_plans = CLAMP(multifocus->number_of_plans, 1, MAX_PLANS);
+    int length = 0;
+
+    if (multifocus->cycle_order == CYCLE_CUSTOM)
+    {
+        char *cursor = multifocus->cycle_sequence;
+        char *end;
+
+        while (cursor != NULL && *cursor != 0 && length < 2 * MAX_PLANS)
+        {
+            long index = strtol(cursor, &end, 10);
+
+            if (end == cursor)
+            {
+                cursor++;
+                continue;
+            }
+            if (index >= 0 && index < nb_plans)
+                multifocus->cycle[length++] = index;
+            cursor = end;
+        }
+        if (length == 0)
+            GST_WARNING_OBJECT(multifocus, "no valid plan in cycle-sequence \"%s\", using the array order", multifocus->cycle_sequence);
+    }
+
+    if (length == 0)
+    {
+        for (int i = 0; i < nb_plans; i++)
+        {
+            multifocus->cycle[length++] = i;
+        }
+
+        if (multifocus->cycle_order == CYCLE_SORTED || multifocus->cycle_order == CYCLE_PING_PONG)
+        {
+            // Insertion sort on the PDA, there are only a few plans
+            for (int i = 1; i < nb_plans; i++)
+            {
+                int plan = multifocus->cycle[i];
+                int j = i - 1;
+
+                while (j >= 0 && plans_int[multifocus->cycle[j]] > plans_int[plan])
+                {
+                    multifocus->cycle[j + 1] = multifocus->cycle[j];
+                    j--;
+                }
+                multifocus->cycle[j + 1] = plan;
+            }
+        }
+
+        if (multifocus->cycle_order == CYCLE_PING_PONG)
+        {
+            // Back down without visiting the ends twice
+            for (int i = nb_plans - 2; i > 0; i--)
+            {
+                multifocus->cycle[length++] = multifocus->cycle[i];
+            }
+        }
+    }
+
+    multifocus->cycle_length = length;
+    multifocus->cycle_position = 0;
+    current_focus = multifocus->cycle[0];
+}
+
+/* Move current_focus to the next plan of the cycle */
+static void advance_cycle(Gstmultifocus *multifocus)
+{
+    multifocus->cycle_position++;
+    if (multifocus->cycle_position >= multifocus->cycle_length)
+    {
+        // The plans may have changed since the cycle was built
+        build_cycle(multifocus);
+        return;
+    }
+    current_focus = multifocus->cycle[multifocus->cycle_position];
+}
+
+/* Start a ramp sweep from the sweep range low end to its high end. The
+ * lens is first sent to the low end and given "latency" frames to get there.
+ * Returns FALSE when the frames can't be placed on the ramp, the sweep then
+ * goes step by step.
+ */
+static gboolean ramp_begin(Gstmultifocus *multifocus, GstBuffer *buf)
+{
+    GstClock *clock = gst_element_get_clock(GST_ELEMENT(multifocus));
+    GstClockTime frame_duration = GST_BUFFER_DURATION_IS_VALID(buf) ? GST_BUFFER_DURATION(buf) : 33 * GST_MSECOND;
+    int last = 80 - sweep_latency(multifocus);
+
+    ramp_end(multifocus);
+
+    if (clock == NULL || !GST_CLOCK_TIME_IS_VALID(mid_exposure_time(multifocus, buf)))
+    {
+        GST_WARNING_OBJECT(multifocus, "ramp sweep needs a clock and timestamped frames, sweeping step by step");
+        if (clock != NULL)
+            gst_object_unref(clock);
+        return false;
+    }
+
+    // Only the PDA reached by the ramp get a sample, the others are interpolated
+    for (int i = 1; i <= last; i++)
+    {
+        sharpness_of_plans[i] = SHARPNESS_SKIPPED;
+    }
+
+    multifocus->ramp_from = -80;
+    multifocus->ramp_to = (last - 9) * 10;
+    multifocus->ramp_written = multifocus->ramp_from;
+    command_lens(multifocus, -1, multifocus->ramp_from);
+
+    multifocus->ramp_clock = clock;
+    multifocus->ramp_start = gst_clock_get_time(clock) + multifocus->latency * frame_duration;
+    g_atomic_int_set(&multifocus->ramp_stop, 0);
+    pthread_create(&multifocus->ramp_thread, NULL, ramp_thread, multifocus);
+
+    return true;
+}
+
+static void ramp_end(Gstmultifocus *multifocus)
+{
+    if (multifocus->ramp_clock == NULL)
+        return;
+
+    g_atomic_int_set(&multifocus->ramp_stop, 1);
+    pthread_join(multifocus->ramp_thread, NULL);
+    gst_object_unref(multifocus->ramp_clock);
+    multifocus->ramp_clock = NULL;
+    multifocus->sweep_ramp = false;
+
+    // The ramp may have been stopped before its end
+    lensModel.lastPda = g_atomic_int_get(&multifocus->ramp_written);
+    lensModel.lastPdaKnown = true;
+}
+
+/* Follow the ramp with the finest PDA steps the lens accepts */
+static void *ramp_thread(void *data)
+{
+    Gstmultifocus *multifocus = (Gstmultifocus *)data;
+    GstClockTime end = multifocus->ramp_start + multifocus->ramp_duration_ms * GST_MSECOND;
+    int last_pda = multifocus->ramp_from;
+
+    while (!g_atomic_int_get(&multifocus->ramp_stop))
+    {
+        GstClockTime now = gst_clock_get_time(multifocus->ramp_clock);
+        int pda = ramp_position(multifocus, now);
+
+        if (pda != last_pda)
+        {
+            gint64 start = g_get_monotonic_time();
+
+            trace_lens(multifocus, "issued", -1, pda);
+            write_VdacPda(devicepda, bus, pda);
+            record_stage(multifocus, STAGE_I2C, start);
+            trace_lens(multifocus, "written", -1, pda);
+            g_atomic_int_set(&multifocus->ramp_written, pda);
+            last_pda = pda;
+        }
+        if (now >= end)
+            break;
+
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+/* PDA of the lens along the ramp at a clock time */
+static int ramp_position(Gstmultifocus *multifocus, GstClockTime time)
+{
+    GstClockTime duration = multifocus->ramp_duration_ms * GST_MSECOND;
+
+    if (time <= multifocus->ramp_start)
+        return multifocus->ramp_from;
+    if (time >= multifocus->ramp_start + duration)
+        return multifocus->ramp_to;
+
+    return multifocus->ramp_from +
+           (gint64)(multifocus->ramp_to - multifocus->ramp_from) * (gint64)(time - multifocus->ramp_start) / (gint64)duration;
+}
+
+/* Delay between a PDA written along the ramp and the frames showing it. The
+ * calibrated delay is counted in frames from the command to the frame.
+ */
+static GstClockTime ramp_lag(Gstmultifocus *multifocus)
+{
+    if (multifocus->ramp_lag_ms >= 0)
+        return multifocus->ramp_lag_ms * GST_MSECOND;
+    if (multifocus->lens_delay > 0 && GST_CLOCK_TIME_IS_VALID(multifocus->frame_duration))
+        return multifocus->lens_delay * multifocus->frame_duration;
+
+    return 0;
+}
+
+/* Clock time at the middle of the exposure of a frame, assuming its PTS is
+ * the start of the exposure like with live sources.
+ */
+static GstClockTime mid_exposure_time(Gstmultifocus *multifocus, GstBuffer *buf)
+{
+    GstClockTime running_time;
+
+    if (!GST_BUFFER_PTS_IS_VALID(buf))
+        return GST_CLOCK_TIME_NONE;
+
+    running_time = gst_segment_to_running_time(&multifocus->segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buf));
+    if (!GST_CLOCK_TIME_IS_VALID(running_time))
+        return GST_CLOCK_TIME_NONE;
+
+    running_time += gst_element_get_base_time(GST_ELEMENT(multifocus));
+    if (GST_BUFFER_DURATION_IS_VALID(buf))
+        running_time += GST_BUFFER_DURATION(buf) / 2;
+
+    return running_time;
+}
+
+/* One frame of a ramp sweep: the frame is sampled into the bin of the PDA
+ * the lens had at the middle of its exposure, the PDA commanded the lag
+ * before, keeping the sharpest frame of each bin. Returns TRUE once the
+ * frames are past the end of the ramp.
+ */
+static gboolean ramp_sweep(GstPad *pad, GstBuffer *buf, int last, Gstmultifocus *multifocus)
+{
+    GstClockTime end = multifocus->ramp_start + multifocus->ramp_duration_ms * GST_MSECOND;
+    GstClockTime mid = mid_exposure_time(multifocus, buf);
+    GstClockTime lag = ramp_lag(multifocus);
+
+    // Time at which the PDA shown by the frame was commanded
+    if (GST_CLOCK_TIME_IS_VALID(mid))
+        mid = (mid > lag) ? mid - lag : 0;
+
+    if (!GST_CLOCK_TIME_IS_VALID(mid) || mid > end ||
+        gst_clock_get_time(multifocus->ramp_clock) > end + lag + GST_SECOND)
+    {
+        // Also give up a second after the end of the ramp if the frames don't get there
+        ramp_end(multifocus);
+        return true;
+    }
+
+    if (mid >= multifocus->ramp_start)
+    {
+        int pda = ramp_position(multifocus, mid);
+        int bin = (pda + 95) / 10;  // Inverse of (bin - 9) * 10, rounded
+        int sample;
+
+        multifocus->frame_pda = pda;
+        if (bin >= 1 && bin <= last)
+        {
+            sample = sweep_sample(pad, buf, pda, multifocus);
+            if (sample > sharpness_of_plans[bin])
+                sharpness_of_plans[bin] = sample;
+        }
+    }
+
+    return false;
+}
+
+/* Keep the nominal frame duration up to date. Without buffer durations the
+ * smallest step between two PTS is used, dropped frames only make it larger.
+ */
+static void track_frame_duration(Gstmultifocus *multifocus, GstBuffer *buf)
+{
+    GstClockTime pts = GST_BUFFER_PTS(buf);
+
+    if (GST_BUFFER_DURATION_IS_VALID(buf))
+    {
+        multifocus->frame_duration = GST_BUFFER_DURATION(buf);
+    }
+    else if (GST_CLOCK_TIME_IS_VALID(pts) && GST_CLOCK_TIME_IS_VALID(multifocus->last_pts) && pts > multifocus->last_pts)
+    {
+        GstClockTime step = pts - multifocus->last_pts;
+
+        if (!GST_CLOCK_TIME_IS_VALID(multifocus->frame_duration) || step < multifocus->frame_duration)
+            multifocus->frame_duration = step;
+    }
+
+    // The offset is the frame number for live sources, the PTS gives it otherwise
+    multifocus->missing_frames = 0;
+    if (GST_BUFFER_OFFSET_IS_VALID(buf) && multifocus->last_offset != GST_BUFFER_OFFSET_NONE)
+    {
+        if (GST_BUFFER_OFFSET(buf) > multifocus->last_offset + 1)
+            multifocus->missing_frames = GST_BUFFER_OFFSET(buf) - multifocus->last_offset - 1;
+    }
+    else if (GST_CLOCK_TIME_IS_VALID(pts) && GST_CLOCK_TIME_IS_VALID(multifocus->last_pts) &&
+             GST_CLOCK_TIME_IS_VALID(multifocus->frame_duration) && pts > multifocus->last_pts)
+    {
+        guint64 frames = (pts - multifocus->last_pts + multifocus->frame_duration / 2) / multifocus->frame_duration;
+
+        if (frames > 1)
+            multifocus->missing_frames = frames - 1;
+    }
+
+    multifocus->last_offset = GST_BUFFER_OFFSET_IS_VALID(buf) ? GST_BUFFER_OFFSET(buf) : GST_BUFFER_OFFSET_NONE;
+    multifocus->last_pts = pts;
+    multifocus->current_pts = pts;
+}
+
+/* A step sweep attributes each frame to the command sent "latency" frames
+ * before it. Frames dropped upstream break that count for the samples of the
+ * next "latency" steps, they will be measured again.
+ */
+static void track_dropped_frames(Gstmultifocus *multifocus, int step, int latency)
+{
+    if (multifocus->missing_frames == 0)
+        return;
+
+    if (multifocus->resampling)
+        step = multifocus->resample_step;
+
+    GST_DEBUG_OBJECT(multifocus, "%u frames dropped at sweep step %d", multifocus->missing_frames, step);
+    multifocus->sweep_invalid_until = step + latency;
+}
+
+/* Measure again the samples invalidated by dropped frames, pipelined like
+ * the sweep: one command per frame, each frame sampled for the command sent
+ * "latency" frames before. A sample hit by another drop is left to the
+ * interpolation. Returns TRUE once every queued sample has been handled.
+ */
+static gboolean resample_step(GstPad *pad, GstBuffer *buf, int latency, Gstmultifocus *multifocus)
+{
+    int step = multifocus->resample_step++;
+
+    if (step >= latency && step - latency < multifocus->resample_count)
+    {
+        int index = multifocus->resample[step - latency];
+
+        if (step < multifocus->sweep_invalid_until)
+            sharpness_of_plans[index] = SHARPNESS_SKIPPED;
+        else
+            sharpness_of_plans[index] = sweep_sample(pad, buf, (index - 9) * 10, multifocus);
+    }
+
+    if (step < multifocus->resample_count)
+        command_lens(multifocus, -1, (multifocus->resample[step] - 9) * 10);
+
+    if (step - latency + 1 < multifocus->resample_count)
+        return false;
+
+    GST_DEBUG_OBJECT(multifocus, "%d sweep samples measured again", multifocus->resample_count);
+    multifocus->resample_count = 0;
+    multifocus->resampling = false;
+    return true;
+}
+
+static void reset_dwell_clock(Gstmultifocus *multifocus)
+{
+    multifocus->switch_pts = GST_CLOCK_TIME_NONE;
+    multifocus->next_switch_pts = GST_CLOCK_TIME_NONE;
+    multifocus->next_switch_frame = -1;
+}
+
+static void parse_plan_weights(Gstmultifocus *multifocus)
+{
+    char *cursor = multifocus->plan_weights;
+    char *end;
+    int plan = 0;
+
+    while (cursor != NULL && *cursor != 0 && plan < MAX_PLANS)
+    {
+        gdouble weight = g_ascii_strtod(cursor, &end);
+
+        if (end == cursor)
+        {
+            cursor++;
+            continue;
+        }
+        multifocus->static_weights[plan++] = MAX(weight, 0);
+        cursor = end;
+    }
+    while (plan < MAX_PLANS)
+    {
+        multifocus->static_weights[plan++] = 1;
+    }
+}
+
+static void reset_plan_activity(Gstmultifocus *multifocus)
+{
+    for (int i = 0; i < MAX_PLANS; i++)
+    {
+        multifocus->plan_level[i] = -1;
+        multifocus->plan_activity[i] = 0;
+        multifocus->plan_last_sharpness[i] = GST_MULTIFOCUS_SHARPNESS_NONE;
+    }
+}
+
+/* Length of the dwell on a plan relative to an even split of the cycle.
+ * When adaptive, the static weights are scaled by how sharp the ROI of the
+ * plan is and how much it changes compared with the other plans, so that
+ * the planes where something happens get more frames.
+ */
+static gdouble dwell_factor(Gstmultifocus *multifocus, int plan)
+{
+    int nb_plans = CLAMP(multifocus->number_of_plans, 1, MAX_PLANS);
+    gdouble weights[MAX_PLANS];
+    gdouble total = 0;
+    gdouble mean_level = 0, mean_activity = 0;
+    int measured = 0;
+
+    if (plan < 0 || plan >= nb_plans)
+        return 1;
+
+    if (multifocus->adaptive_dwell)
+    {
+        for (int i = 0; i < nb_plans; i++)
+        {
+            if (multifocus->plan_level[i] < 0)
+                continue;
+            mean_level += multifocus->plan_level[i];
+            mean_activity += multifocus->plan_activity[i];
+            measured++;
+        }
+        if (measured > 0)
+        {
+            mean_level /= measured;
+            mean_activity /= measured;
+        }
+    }
+
+    for (int i = 0; i < nb_plans; i++)
+    {
+        weights[i] = multifocus->static_weights[i];
+
+        if (multifocus->adaptive_dwell && multifocus->plan_level[i] >= 0 && mean_level > 0)
+        {
+            gdouble score = multifocus->plan_level[i] / mean_level;
+
+            if (mean_activity > 0)
+                score = (score + multifocus->plan_activity[i] / mean_activity) / 2;
+            weights[i] *= CLAMP(score, 0.25, 4.0);
+        }
+        total += weights[i];
+    }
+
+    if (total <= 0)
+        return 1;
+
+    return weights[plan] * nb_plans / total;
+}
+
+/* Set the end of the dwell starting on this frame */
+static void schedule_dwell_end(Gstmultifocus *multifocus, GstBuffer *buf, int plan)
+{
+    gdouble factor = dwell_factor(multifocus, plan);
+    int frames = (int)((multifocus->space_between_switch + 1) * factor + 0.5);
+
+    multifocus->dwell_frames = MAX(frames, 1);
+    multifocus->next_switch_frame = frame + multifocus->dwell_frames;
+    if (multifocus->dwell_time > 0 && GST_BUFFER_PTS_IS_VALID(buf))
+        multifocus->next_switch_pts = GST_BUFFER_PTS(buf) + (GstClockTime)(multifocus->dwell_time * factor);
+
+    multifocus->dwell_measured = false;
+}
+
+/* Fold the sharpness of a settled frame into the averages of its plan */
+static void measure_plan_activity(Gstmultifocus *multifocus, int plan, gint64 sharpness)
+{
+    gint64 previous = multifocus->plan_last_sharpness[plan];
+
+    if (multifocus->plan_level[plan] < 0)
+        multifocus->plan_level[plan] = sharpness;
+    else
+        multifocus->plan_level[plan] = (3 * multifocus->plan_level[plan] + sharpness) / 4;
+
+    if (previous != GST_MULTIFOCUS_SHARPNESS_NONE)
+    {
+        gdouble change = (gdouble)ABS(sharpness - previous) / MAX(previous, 1);
+        multifocus->plan_activity[plan] = (3 * multifocus->plan_activity[plan] + change) / 4;
+    }
+
+    multifocus->plan_last_sharpness[plan] = sharpness;
+    multifocus->dwell_measured = true;
+}
+
+/* Compare the frame with the scene the plans were detected on, and start a
+ * new detection once it has been different for SCENE_CHANGE_FRAMES frames in
+ * a row, so that a passing object doesn't trigger one. The first frame after
+ * a detection becomes the reference.
+ */
+static void detect_scene_change(Gstmultifocus *multifocus, GstBuffer *buf, int width, int height)
+{
+    unsigned char fingerprint[SCENE_GRID * SCENE_GRID];
+    GstMapInfo map;
+    int distance;
+
+    if (!gst_buffer_map(buf, &map, GST_MAP_READ))
+        return;
+    if (map.size < (gsize)width * height)
+    {
+        gst_buffer_unmap(buf, &map);
+        return;
+    }
+    sceneFingerprint(map.data, width, height, fingerprint);
+    gst_buffer_unmap(buf, &map);
+
+    if (!multifocus->scene_reference_valid)
+    {
+        memcpy(multifocus->scene_reference, fingerprint, sizeof(fingerprint));
+        multifocus->scene_reference_valid = true;
+        multifocus->scene_changed_frames = 0;
+        return;
+    }
+
+    distance = fingerprintDistance(multifocus->scene_reference, fingerprint);
+    if (distance < multifocus->scene_change_threshold)
+    {
+        multifocus->scene_changed_frames = 0;
+        return;
+    }
+
+    if (++multifocus->scene_changed_frames >= SCENE_CHANGE_FRAMES)
+    {
+        GST_INFO_OBJECT(multifocus, "scene changed (distance %d), detecting the plans again", distance);
+        multifocus->scene_reference_valid = false;
+        multifocus->scene_changed_frames = 0;
+        multifocus->reset = true;
+    }
+}
+
+/* Whether the dwell on the current plan ends within "ahead" frames. With a
+ * dwell-time and timestamped frames the end is a PTS, so that dropped frames
+ * don't stretch the dwell; otherwise it is a frame number. Both are set by
+ * schedule_dwell_end() from the weight of the plan.
+ */
+static gboolean dwell_over(Gstmultifocus *multifocus, GstBuffer *buf, guint ahead)
+{
+    if (multifocus->dwell_time > 0 && GST_BUFFER_PTS_IS_VALID(buf) && GST_CLOCK_TIME_IS_VALID(multifocus->frame_duration))
+    {
+        if (!GST_CLOCK_TIME_IS_VALID(multifocus->next_switch_pts))
+            return ahead == 0;
+
+        return GST_BUFFER_PTS(buf) + ahead * multifocus->frame_duration >= multifocus->next_switch_pts;
+    }
+
+    if (multifocus->next_switch_frame < 0)
+        return ahead == 0;
+
+    return frame + (int)ahead >= multifocus->next_switch_frame;
+}
+
+/* Whether the lens had time to settle since the last command: on the
+ * timestamps when the dwell is timed, on the number of frames otherwise.
+ */
+static gboolean is_settled(Gstmultifocus *multifocus, GstBuffer *buf)
+{
+    if (multifocus->dwell_time > 0 && GST_BUFFER_PTS_IS_VALID(buf) &&
+        GST_CLOCK_TIME_IS_VALID(multifocus->switch_pts) && GST_CLOCK_TIME_IS_VALID(multifocus->frame_duration))
+    {
+        return GST_BUFFER_PTS(buf) >= multifocus->switch_pts + multifocus->switch_settle * multifocus->frame_duration;
+    }
+
+    return multifocus->frames_since_switch >= multifocus->switch_settle;
+}
+
+/* Replace the skipped samples in [first, last] by a linear interpolation of
+ * the closest measured samples.
+ */
+static void fill_skipped_samples(int *tab, int first, int last)
+{
+    int prev = -1;
+
+    for (int i = first; i <= last; i++)
+    {
+        int next = i + 1;
+
+        if (tab[i] != SHARPNESS_SKIPPED)
+        {
+            prev = i;
+            continue;
+        }
+
+        while (next <= last && tab[next] == SHARPNESS_SKIPPED)
+        {
+            next++;
+        }
+
+        if (prev < 0 && next > last)
+            tab[i] = 0;
+        else if (prev < 0)
+            tab[i] = tab[next];
+        else if (next > last)
+            tab[i] = tab[prev];
+        else
+            tab[i] = tab[prev] + (tab[next] - tab[prev]) * (i - prev) / (next - prev);
+    }
+}
+
+void constructString(char* string, int *tab,int size)
+{
+	string[0]=0;
+	for(int i=0;i<size;i++)
+	{
+		int err;
+		err = sprintf(string + strlen(string),"%d;",tab[i]);
+		if(err == -1)
+		{
+			return;
+		}
+	}
+}
+void parseString(char* string, int *tab,int size)
+{
+
+	for(int i=0;i<size;i++)
+	{
+		int size_of_number;
+		char tmp[10];
+		size_of_number = sscanf(string,"%d;",&(tab[i]));
+		if(size_of_number<0)
+			return;
+
+		snprintf(tmp,10,"%d",tab[i]);
+		string+=strlen(tmp)+1;
+		//printf("tab[%d] : %d\n",i,tab[i]);
+
+	}
+}
+
+void check_ROI_with_frame(gint *width,gint *height, ROI *roi)
+{
+
+            	if(roi->height>*height)
+            	{
+            		roi->height=*height-roi->y;
+            	}
+            
+            	if(roi->width>*width)
+            	{
+            		roi->width=*width-roi->x;
+            	}
+}
+
+
+static void gst_multifocus_reset_qos(Gstmultifocus *multifocus)
+{
+    GST_OBJECT_LOCK(multifocus);
+    multifocus->qos_proportion = 1.0;
+    multifocus->qos_earliest_time = GST_CLOCK_TIME_NONE;
+    GST_OBJECT_UNLOCK(multifocus);
+}
+
+/* A buffer is late when its running time is before the earliest time
+ * downstream reported in its last QoS event.
+ */
+static gboolean gst_multifocus_is_late(Gstmultifocus *multifocus, GstBuffer *buf)
+{
+    GstClockTime running_time;
+    GstClockTime earliest_time;
+
+    if (multifocus->segment.format != GST_FORMAT_TIME || !GST_BUFFER_PTS_IS_VALID(buf))
+        return FALSE;
+
+    running_time = gst_segment_to_running_time(&multifocus->segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buf));
+
+    GST_OBJECT_LOCK(multifocus);
+    earliest_time = multifocus->qos_earliest_time;
+    GST_OBJECT_UNLOCK(multifocus);
+
+    return GST_CLOCK_TIME_IS_VALID(running_time) && GST_CLOCK_TIME_IS_VALID(earliest_time) && running_time <= earliest_time;
+}
+
+/* Build the stream-start event of a plan pad from the upstream one */
+static GstEvent *gst_multifocus_plan_stream_start(GstEvent *event, guint plan)
+{
+    const gchar *upstream_id;
+    gchar *stream_id;
+    guint group_id;
+    GstEvent *plan_event;
+
+    gst_event_parse_stream_start(event, &upstream_id);
+    stream_id = g_strdup_printf("%s/plan%u", GST_STR_NULL(upstream_id), plan);
+    plan_event = gst_event_new_stream_start(stream_id);
+    g_free(stream_id);
+
+    if (gst_event_parse_group_id(event, &group_id))
+        gst_event_set_group_id(plan_event, group_id);
+    gst_event_set_seqnum(plan_event, gst_event_get_seqnum(event));
+
+    return plan_event;
+}
+
+/* Copy the sticky events of the sink pad on a new plan pad so that it gets
+ * its stream-start, caps and segment before its first buffer.
+ */
+static gboolean gst_multifocus_copy_sticky(GstPad *pad, GstEvent **event, gpointer user_data)
+{
+    GstPad *plan_pad = GST_PAD(user_data);
+
+    if (GST_EVENT_TYPE(*event) == GST_EVENT_STREAM_START)
+    {
+        guint plan = GPOINTER_TO_UINT(plan_pad->element_private);
+        GstEvent *plan_event = gst_multifocus_plan_stream_start(*event, plan);
+
+        gst_pad_store_sticky_event(plan_pad, plan_event);
+        gst_event_unref(plan_event);
+    }
+    else
+    {
+        gst_pad_store_sticky_event(plan_pad, *event);
+    }
+
+    return TRUE;
+}
+
+static GstPad *gst_multifocus_request_new_pad(GstElement *element, GstPadTemplate *templ,
+                                              const gchar *name, const GstCaps *caps)
+{
+    Gstmultifocus *multifocus = GST_multifocus(element);
+    guint plan = 0;
+    GstPad *pad;
+    gchar *pad_name;
+
+    GST_OBJECT_LOCK(multifocus);
+    if (name != NULL)
+    {
+        if (sscanf(name, "src_%u", &plan) != 1 || plan >= MAX_PLANS || multifocus->plan_srcpads[plan] != NULL)
+        {
+            GST_OBJECT_UNLOCK(multifocus);
+            GST_WARNING_OBJECT(multifocus, "invalid or already used pad name %s", name);
+            return NULL;
+        }
+    }
+    else
+    {
+        while (plan < MAX_PLANS && multifocus->plan_srcpads[plan] != NULL)
+        {
+            plan++;
+        }
+        if (plan >= MAX_PLANS)
+        {
+            GST_OBJECT_UNLOCK(multifocus);
+            GST_WARNING_OBJECT(multifocus, "no plan left for a new pad");
+            return NULL;
+        }
+    }
+
+    pad_name = g_strdup_printf("src_%u", plan);
+    pad = gst_pad_new_from_template(templ, pad_name);
+    g_free(pad_name);
+
+    pad->element_private = GUINT_TO_POINTER(plan);
+    multifocus->plan_srcpads[plan] = pad;
+    multifocus->plan_srcpads_next[plan] = GST_CLOCK_TIME_NONE;
+    gst_flow_combiner_add_pad(multifocus->flow_combiner, pad);
+    GST_OBJECT_UNLOCK(multifocus);
+
+    gst_pad_set_event_function(pad, GST_DEBUG_FUNCPTR(gst_multifocus_src_event));
+    GST_PAD_SET_PROXY_CAPS(pad);
+    if (GST_PAD_IS_ACTIVE(multifocus->sinkpad))
+    {
+        // The stream is already running, the new pad must catch up with it
+        gst_pad_set_active(pad, TRUE);
+        gst_pad_sticky_events_foreach(multifocus->sinkpad, gst_multifocus_copy_sticky, pad);
+    }
+    gst_element_add_pad(element, pad);
+
+    return pad;
+}
+
+static void gst_multifocus_release_pad(GstElement *element, GstPad *pad)
+{
+    Gstmultifocus *multifocus = GST_multifocus(element);
+    guint plan = GPOINTER_TO_UINT(pad->element_private);
+
+    GST_OBJECT_LOCK(multifocus);
+    if (plan < MAX_PLANS && multifocus->plan_srcpads[plan] == pad)
+    {
+        multifocus->plan_srcpads[plan] = NULL;
+    }
+    gst_flow_combiner_remove_pad(multifocus->flow_combiner, pad);
+    GST_OBJECT_UNLOCK(multifocus);
+
+    gst_pad_set_active(pad, FALSE);
+    gst_element_remove_pad(element, pad);
+}
+
+static gboolean gst_multifocus_sink_event(GstPad *pad, GstObject *parent, GstEvent *event)
+{
+    Gstmultifocus *multifocus = GST_multifocus(parent);
+
+    switch (GST_EVENT_TYPE(event))
+    {
+    case GST_EVENT_SEGMENT:
+        gst_event_copy_segment(event, &multifocus->segment);
+        gst_multifocus_reset_qos(multifocus);
+        break;
+    case GST_EVENT_FLUSH_STOP:
+        gst_segment_init(&multifocus->segment, GST_FORMAT_UNDEFINED);
+        gst_multifocus_reset_qos(multifocus);
+        GST_OBJECT_LOCK(multifocus);
+        gst_flow_combiner_reset(multifocus->flow_combiner);
+        for (int i = 0; i < MAX_PLANS; i++)
+        {
+            multifocus->plan_srcpads_next[i] = GST_CLOCK_TIME_NONE;
+        }
+        GST_OBJECT_UNLOCK(multifocus);
+        output_reset(multifocus);
+        reset_dwell_clock(multifocus);
+        multifocus->last_pts = GST_CLOCK_TIME_NONE;
+        multifocus->last_offset = GST_BUFFER_OFFSET_NONE;
+        break;
+    case GST_EVENT_STREAM_START:
+        // Each plan pad is a stream of its own, derived from the upstream one
+        for (int i = 0; i < MAX_PLANS; i++)
+        {
+            GstPad *plan_pad = NULL;
+
+            GST_OBJECT_LOCK(multifocus);
+            if (multifocus->plan_srcpads[i] != NULL)
+                plan_pad = gst_object_ref(multifocus->plan_srcpads[i]);
+            GST_OBJECT_UNLOCK(multifocus);
+
+            if (plan_pad != NULL)
+            {
+                gst_pad_push_event(plan_pad, gst_multifocus_plan_stream_start(event, i));
+                gst_object_unref(plan_pad);
+            }
+        }
+        return gst_pad_push_event(multifocus->srcpad, event);
+    case GST_EVENT_CUSTOM_DOWNSTREAM:
+        // Serialized, it applies to the buffer following it
+        if (gst_multifocus_control_event(multifocus, event))
+            return TRUE;
+        break;
+    default:
+        break;
+    }
+
+    return gst_pad_event_default(pad, parent, event);
+}
+
+static gboolean gst_multifocus_src_event(GstPad *pad, GstObject *parent, GstEvent *event)
+{
+    Gstmultifocus *multifocus = GST_multifocus(parent);
+
+    if (GST_EVENT_TYPE(event) == GST_EVENT_QOS)
+    {
+        GstQOSType type;
+        gdouble proportion;
+        GstClockTimeDiff diff;
+        GstClockTime timestamp;
+
+        gst_event_parse_qos(event, &type, &proportion, &diff, &timestamp);
+
+        GST_OBJECT_LOCK(multifocus);
+        multifocus->qos_proportion = proportion;
+        if (!GST_CLOCK_TIME_IS_VALID(timestamp))
+        {
+            multifocus->qos_earliest_time = GST_CLOCK_TIME_NONE;
+        }
+        else if (diff > 0)
+        {
+            // We are late, give downstream some room to catch up
+            multifocus->qos_earliest_time = timestamp + 2 * diff;
+        }
+        else
+        {
+            multifocus->qos_earliest_time = ((GstClockTimeDiff)timestamp > -diff) ? timestamp + diff : 0;
+        }
+        GST_OBJECT_UNLOCK(multifocus);
+
+        GST_LOG_OBJECT(multifocus, "QoS proportion %f, diff %" G_GINT64_FORMAT " at %" GST_TIME_FORMAT,
+                       proportion, diff, GST_TIME_ARGS(timestamp));
+    }
+    else if (GST_EVENT_TYPE(event) == GST_EVENT_CUSTOM_UPSTREAM)
+    {
+        // Not serialized, it applies to the next buffer reaching the element
+        if (gst_multifocus_control_event(multifocus, event))
+            return TRUE;
+    }
+
+    return gst_pad_event_default(pad, parent, event);
+}
+
+/* Handle the custom events controlling the element. The requests are only
+ * recorded here, the streaming thread applies them on the next buffer.
+ * Returns FALSE, leaving the event to the caller, if it isn't one of ours.
+ */
+static gboolean gst_multifocus_control_event(Gstmultifocus *multifocus, GstEvent *event)
+{
+    const GstStructure *s = gst_event_get_structure(event);
+
+    if (s == NULL)
+        return FALSE;
+
+    if (gst_structure_has_name(s, GST_MULTIFOCUS_EVENT_GO_TO_PLAN))
+    {
+        gint plan;
+
+        if (gst_structure_get_int(s, "plan", &plan) && plan >= 0 && plan < MAX_PLANS)
+        {
+            GST_DEBUG_OBJECT(multifocus, "go to plan %d requested", plan);
+            g_atomic_int_set(&multifocus->goto_plan, plan);
+        }
+        else
+        {
+            GST_WARNING_OBJECT(multifocus, "ignoring " GST_MULTIFOCUS_EVENT_GO_TO_PLAN " event without a valid plan");
+        }
+    }
+    else if (gst_structure_has_name(s, GST_MULTIFOCUS_EVENT_REDETECT))
+    {
+        GST_DEBUG_OBJECT(multifocus, "plan detection requested");
+        g_atomic_int_set(&multifocus->redetect_pending, 1);
+    }
+    else if (gst_structure_has_name(s, GST_MULTIFOCUS_EVENT_PAUSE))
+    {
+        gboolean paused = TRUE;
+
+        gst_structure_get_boolean(s, "paused", &paused);
+        GST_DEBUG_OBJECT(multifocus, "cycling %s", paused ? "paused" : "resumed");
+        g_atomic_int_set(&multifocus->cycle_paused, paused ? 1 : 0);
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    gst_event_unref(event);
+    return TRUE;
+}
+
+/* Switch to a plan requested by an event, the cycle then carries on from the
+ * plan following it. A partial fused or best frame would mix two cycles, it
+ * is dropped.
+ */
+static void go_to_plan(Gstmultifocus *multifocus, GstBuffer *buf, int plan)
+{
+    if (multifocus->cycle_length == 0)
+    {
+        build_cycle(multifocus);
+    }
+    output_reset(multifocus);
+    schedule_dwell_end(multifocus, buf, plan);
+    command_lens(multifocus, plan, plans_int[plan]);
+    multifocus->predicted_plan = -1;
+
+    for (int i = 0; i < multifocus->cycle_length; i++)
+    {
+        if (multifocus->cycle[i] == plan)
+        {
+            multifocus->cycle_position = i;
+            advance_cycle(multifocus);
+            break;
+        }
+    }
+}
+
+/* Drop a frame taken while the lens is settling. If the frame was meant for
+ * the src pad, downstream is told about the hole in the stream with a gap
+ * event.
+ */
+static GstFlowReturn gst_multifocus_drop_frame(Gstmultifocus *multifocus, GstBuffer *buf, gboolean to_src)
+{
+    guint dropped = g_atomic_int_add((gint *)&multifocus->dropped_frames, 1) + 1;
+
+    GST_LOG_OBJECT(multifocus, "dropping transitional frame %" GST_TIME_FORMAT " (%u dropped)",
+                   GST_TIME_ARGS(GST_BUFFER_PTS(buf)), dropped);
+
+    if (to_src && GST_BUFFER_PTS_IS_VALID(buf))
+    {
+        gst_pad_push_event(multifocus->srcpad, gst_event_new_gap(GST_BUFFER_PTS(buf), GST_BUFFER_DURATION(buf)));
+    }
+    gst_buffer_unref(buf);
+
+    return GST_FLOW_OK;
+}
+
+/* Push a frame on the src pad if to_src is set and, when it was taken at a
+ * plan, on the request pad of that plan. The plan pads only see a part of
+ * the stream so the holes between their buffers are announced with gap
+ * events.
+ */
+static GstFlowReturn gst_multifocus_push(Gstmultifocus *multifocus, GstBuffer *buf, int plan, gboolean to_src)
+{
+    GstPad *plan_pad = NULL;
+    GstClockTime hole_start = GST_CLOCK_TIME_NONE;
+    GstFlowReturn ret = GST_FLOW_OK;
+    gint64 start;
+
+    if (plan >= 0 && plan < MAX_PLANS)
+    {
+        GST_OBJECT_LOCK(multifocus);
+        if (multifocus->plan_srcpads[plan] != NULL)
+        {
+            plan_pad = gst_object_ref(multifocus->plan_srcpads[plan]);
+            hole_start = multifocus->plan_srcpads_next[plan];
+            if (GST_BUFFER_PTS_IS_VALID(buf))
+            {
+                multifocus->plan_srcpads_next[plan] = GST_BUFFER_PTS(buf) +
+                    (GST_BUFFER_DURATION_IS_VALID(buf) ? GST_BUFFER_DURATION(buf) : 0);
+            }
+        }
+        GST_OBJECT_UNLOCK(multifocus);
+    }
+
+    if (plan_pad != NULL)
+    {
+        if (GST_CLOCK_TIME_IS_VALID(hole_start) && GST_BUFFER_PTS_IS_VALID(buf) && GST_BUFFER_PTS(buf) > hole_start)
+        {
+            gst_pad_push_event(plan_pad, gst_event_new_gap(hole_start, GST_BUFFER_PTS(buf) - hole_start));
+        }
+
+        start = g_get_monotonic_time();
+        ret = gst_pad_push(plan_pad, gst_buffer_ref(buf));
+        record_stage(multifocus, STAGE_PUSH, start);
+
+        GST_OBJECT_LOCK(multifocus);
+        ret = gst_flow_combiner_update_pad_flow(multifocus->flow_combiner, plan_pad, ret);
+        GST_OBJECT_UNLOCK(multifocus);
+        gst_object_unref(plan_pad);
+    }
+
+    if (!to_src)
+    {
+        gst_buffer_unref(buf);
+        return ret;
+    }
+
+    start = g_get_monotonic_time();
+    ret = gst_pad_push(multifocus->srcpad, buf);
+    record_stage(multifocus, STAGE_PUSH, start);
+
+    GST_OBJECT_LOCK(multifocus);
+    ret = gst_flow_combiner_update_pad_flow(multifocus->flow_combiner, multifocus->srcpad, ret);
+    GST_OBJECT_UNLOCK(multifocus);
+
+    return ret;
+}
+
+/* Forget the frames kept for the cycle in progress */
+static void output_reset(Gstmultifocus *multifocus)
+{
+    gst_buffer_replace(&multifocus->fusion_pending, NULL);
+    multifocus->fusion_pending_plan = -1;
+    multifocus->fusion_filled = 0;
+
+    gst_buffer_replace(&multifocus->best_pending, NULL);
+    multifocus->best_pending_sharpness = GST_MULTIFOCUS_SHARPNESS_NONE;
+
+    // An interrupted burst starts over, the trigger stays pending
+    if (multifocus->burst_active)
+    {
+        gst_buffer_list_unref(multifocus->burst_list);
+        multifocus->burst_list = NULL;
+        multifocus->burst_active = false;
+        g_atomic_int_set(&multifocus->trigger_pending, 1);
+    }
+}
+
+static void gst_multifocus_trigger(Gstmultifocus *multifocus)
+{
+    GST_DEBUG_OBJECT(multifocus, "focal stack capture triggered");
+    g_atomic_int_set(&multifocus->trigger_pending, 1);
+}
+
+/* Push the captured focal stack on the src pad, its frames are ordered like
+ * the plans and carry their plan meta.
+ */
+static GstFlowReturn gst_multifocus_push_burst(Gstmultifocus *multifocus)
+{
+    GstBufferList *list = multifocus->burst_list;
+    GstFlowReturn ret;
+    gint64 start;
+
+    multifocus->burst_list = NULL;
+    multifocus->burst_active = false;
+
+    GST_DEBUG_OBJECT(multifocus, "pushing a focal stack of %u frames", gst_buffer_list_length(list));
+
+    start = g_get_monotonic_time();
+    ret = gst_pad_push_list(multifocus->srcpad, list);
+    record_stage(multifocus, STAGE_PUSH, start);
+
+    GST_OBJECT_LOCK(multifocus);
+    ret = gst_flow_combiner_update_pad_flow(multifocus->flow_combiner, multifocus->srcpad, ret);
+    GST_OBJECT_UNLOCK(multifocus);
+
+    return ret;
+}
+
+/* Called when the lens leaves a plan: the latest settled frame taken at the
+ * plan becomes its slice of the focal stack. Once every plan of the cycle has
+ * a slice the fused frame is returned, NULL otherwise.
+ */
+static GstBuffer *fusion_end_dwell(Gstmultifocus *multifocus, gint width, gint height)
+{
+    GstMapInfo map;
+    GstBuffer *fused;
+    GstClockTime pts;
+    guint64 all_planes = 0;
+    unsigned char *sources[MAX_PLANS];
+    int nb_planes = 0;
+
+    if (multifocus->fusion_pending == NULL || height <= 0)
+        return NULL;
+
+    pts = GST_BUFFER_PTS(multifocus->fusion_pending);
+    gst_buffer_map(multifocus->fusion_pending, &map, GST_MAP_READ);
+
+    if (map.size != multifocus->fusion_frame_size)
+    {
+        // New frame size, the stack has to be rebuilt
+        for (int i = 0; i < MAX_PLANS; i++)
+        {
+            g_free(multifocus->fusion_planes[i]);
+            multifocus->fusion_planes[i] = NULL;
+        }
+        multifocus->fusion_frame_size = map.size;
+        multifocus->fusion_filled = 0;
+    }
+
+    if (multifocus->fusion_planes[multifocus->fusion_pending_plan] == NULL)
+        multifocus->fusion_planes[multifocus->fusion_pending_plan] = g_malloc(map.size);
+
+    memcpy(multifocus->fusion_planes[multifocus->fusion_pending_plan], map.data, map.size);
+    multifocus->fusion_filled |= G_GUINT64_CONSTANT(1) << multifocus->fusion_pending_plan;
+
+    gst_buffer_unmap(multifocus->fusion_pending, &map);
+    gst_buffer_replace(&multifocus->fusion_pending, NULL);
+
+    // A custom cycle may leave plans out, only the visited ones make the stack
+    for (int i = 0; i < multifocus->cycle_length; i++)
+    {
+        all_planes |= G_GUINT64_CONSTANT(1) << multifocus->cycle[i];
+    }
+    if (all_planes == 0)
+        all_planes = (G_GUINT64_CONSTANT(1) << MIN(multifocus->number_of_plans, MAX_PLANS)) - 1;
+    if ((multifocus->fusion_filled & all_planes) != all_planes)
+        return NULL;
+
+    for (int i = 0; i < MAX_PLANS; i++)
+    {
+        if (all_planes & (G_GUINT64_CONSTANT(1) << i))
+            sources[nb_planes++] = multifocus->fusion_planes[i];
+    }
+
+    fused = gst_buffer_new_allocate(NULL, multifocus->fusion_frame_size, NULL);
+    gst_buffer_map(fused, &map, GST_MAP_WRITE);
+    fuseFocalStack(sources, nb_planes, map.data, width, height,
+                   multifocus->fusion_frame_size / height, multifocus->fusion_blend);
+    gst_buffer_unmap(fused, &map);
+
+    GST_BUFFER_PTS(fused) = pts;
+    if (GST_CLOCK_TIME_IS_VALID(pts) && GST_CLOCK_TIME_IS_VALID(multifocus->fusion_prev_pts) && pts > multifocus->fusion_prev_pts)
+        GST_BUFFER_DURATION(fused) = pts - multifocus->fusion_prev_pts;
+    multifocus->fusion_prev_pts = pts;
+    multifocus->fusion_filled = 0;
+
+    GST_LOG_OBJECT(multifocus, "fused %d planes at %" GST_TIME_FORMAT, nb_planes, GST_TIME_ARGS(pts));
+
+    return fused;
+}
+
+/* chain function
+ * this function does the actual processing
+ */
+
+
+
+
+
+/* Time the whole processing of each frame, the stages are timed where they
+ * happen.
+ */
+static GstFlowReturn gst_multifocus_chain(GstPad *pad, GstObject *parent, GstBuffer *buf)
+{
+    Gstmultifocus *multifocus = GST_multifocus(parent);
+    gint64 start;
+    GstFlowReturn ret;
+
+    start = g_get_monotonic_time();
+    ret = gst_multifocus_process(pad, parent, buf, start);
+
+    latencyRecord(&multifocus->stage_stats[STAGE_FRAME], g_get_monotonic_time() - start);
+
+    return ret;
+}
+
+static GstFlowReturn gst_multifocus_process(GstPad *pad, GstObject *parent, GstBuffer *buf, gint64 start)
+{
+    Gstmultifocus *multifocus = GST_multifocus(parent);
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    GstStructure *s = gst_caps_get_structure(caps,0);
+
+
+	
+	int route_plan = -1;
+	gboolean fusing = false;
+	gboolean selecting = false;
+	gboolean bursting = false;
+	gboolean burst_done = false;
+	GstBuffer *cycle_buf = NULL;	// Fused or selected frame completing a cycle of plans
+	GstFlowReturn ret;
+
+	multifocus->frame_sharpness = GST_MULTIFOCUS_SHARPNESS_NONE;
+	track_frame_duration(multifocus, buf);
+
+	if(!i2c_err && multifocus->work)
+	{
+		gint width=0,height=0;
+		gboolean settled, transitional;
+		gboolean paused;
+		gint goto_plan;
+		int period = multifocus->space_between_switch + 1;
+		guint lead = multifocus->predictive_switch ? MIN(sweep_latency(multifocus), period) : 0;
+            
+            
+            	gst_structure_get_int(s,"width", &width);
+            	gst_structure_get_int(s,"height", &height);
+		if (multifocus->output_mode == OUTPUT_FUSED)
+		{
+			fusing = g_strcmp0(gst_structure_get_string(s, "format"), "GRAY8") == 0;
+			if (!fusing && !multifocus->fusion_format_warned)
+			{
+				GST_WARNING_OBJECT(multifocus, "fused output mode needs GRAY8 frames, pushing every frame");
+				multifocus->fusion_format_warned = true;
+			}
+		}
+		selecting = multifocus->output_mode == OUTPUT_BEST;
+            	roi.x = multifocus->ROI1x;
+            	roi.y = multifocus->ROI1y;
+            	roi.height = multifocus->ROI2y - multifocus->ROI1y;
+            	roi.width = multifocus->ROI2x - multifocus->ROI1x;
+		check_ROI_with_frame(&width,&height,&roi);
+		record_stage(multifocus, STAGE_SETUP, start);
+		paused = g_atomic_int_get(&multifocus->cycle_paused);
+
+		// Left pending during a calibration, it is handled once the calibration is over
+		if (!multifocus->calibrating && g_atomic_int_compare_and_exchange(&multifocus->redetect_pending, 1, 0))
+		{
+			multifocus->reset = true;
+		}
+
+		if (multifocus->hysteresis_active)
+		{
+			if (hysteresis_step(pad, buf, multifocus))
+			{
+				multifocus->hysteresis_active = false;
+			}
+		}
+		else if (multifocus->calibrating)
+		{
+			output_reset(multifocus);
+			multifocus->predicted_plan = -1;
+			if (calibration_step(pad, buf, multifocus))
+			{
+				multifocus->calibrating = false;
+				// The samples of an interrupted sweep were taken with the old delay and the
+				// lens is now elsewhere, the sweep starts over
+				if (step1 != 0 || step2 != 0)
+				{
+					GST_DEBUG_OBJECT(multifocus, "restarting the sweep interrupted by the calibration");
+					step1 = 0;
+					step2 = 0;
+				}
+			}
+		}
+		else if(multifocus->reset)
+		{
+			int done=0;
+			output_reset(multifocus);
+			multifocus->predicted_plan = -1;
+			multifocus->cycle_length = 0;
+			reset_dwell_clock(multifocus);
+			reset_plan_activity(multifocus);
+			multifocus->scene_reference_valid = false;
+			if(multifocus->auto_detect_plans)
+			{
+				if(multifocus->wait_after_start < frame)
+				{
+
+					done = find_best_plans(pad, buf, &(multifocus->number_of_plans), sweep_latency(multifocus), multifocus);
+
+				}
+				if(done)
+				{
+					constructString(multifocus->plans, plans_int,multifocus->number_of_plans);
+					multifocus->reset=false;
+					multifocus->next=false;
+					step1=0;
+					step2=0;
+					indice_next=0;
+				}
+			
+			}
 			else
 			{
 				if(multifocus->next)
@@ -636,19 +3106,188 @@ static GstFlowReturn gst_multifocus_chain(GstPad *pad, GstObject *parent, GstBuf
 			parseString(multifocus->plans,plans_int,multifocus->number_of_plans);
 			//g_print(" best plans out :%d\n", plans_int[0]);
 
-			if (frame % (multifocus->space_between_switch + 1) == 0)
+			// "reset" may have been cleared in the middle of a ramp, stop it before commanding the plans
+			ramp_end(multifocus);
+
+			if (!multifocus->burst_active && g_atomic_int_compare_and_exchange(&multifocus->trigger_pending, 1, 0))
+			{
+				multifocus->burst_active = true;
+				multifocus->burst_plan = 0;
+				multifocus->burst_list = gst_buffer_list_new_sized(multifocus->number_of_plans);
+			}
+
+			if (multifocus->burst_active)
+			{
+				// The regular cycle is suspended until every plan has been captured
+				bursting = true;
+				if (multifocus->frame_plan != multifocus->burst_plan || multifocus->predicted_plan >= 0)
+				{
+					command_lens(multifocus, multifocus->burst_plan, plans_int[multifocus->burst_plan]);
+					multifocus->predicted_plan = -1;
+				}
+			}
+			else if ((goto_plan = g_atomic_int_get(&multifocus->goto_plan)) >= 0 &&
+			         g_atomic_int_compare_and_exchange(&multifocus->goto_plan, goto_plan, -1))
+			{
+				if (goto_plan < multifocus->number_of_plans)
+				{
+					go_to_plan(multifocus, buf, goto_plan);
+				}
+				else
+				{
+					GST_WARNING_OBJECT(multifocus, "ignoring " GST_MULTIFOCUS_EVENT_GO_TO_PLAN " event for plan %d, only %d plans",
+					                   goto_plan, multifocus->number_of_plans);
+				}
+			}
+			else if (paused && multifocus->predicted_plan >= 0 && multifocus->frame_plan >= 0)
+			{
+				// The next plan was already commanded, bring the lens back to the plan the frames are labelled with
+				command_lens(multifocus, multifocus->frame_plan, plans_int[multifocus->frame_plan]);
+				multifocus->predicted_plan = -1;
+			}
+			else if (!paused && dwell_over(multifocus, buf, 0))
             		{
-                		write_VdacPda(devicepda, bus,plans_int[current_focus]);
-                		current_focus++;
-                		if (current_focus >= multifocus->number_of_plans)
+                		// A short dwell may have cut the lead of the prediction
+                		guint predicted_lead = MIN(lead, multifocus->dwell_frames);
+
+                		if (multifocus->cycle_length == 0)
+                		{
+                			build_cycle(multifocus);
+                		}
+                		schedule_dwell_end(multifocus, buf, current_focus);
+                		if (fusing)
+                		{
+                			cycle_buf = fusion_end_dwell(multifocus, width, height);
+                		}
+                		else if (selecting && multifocus->cycle_position == 0 && multifocus->best_pending != NULL)
+                		{
+                			// Back to the first plan, the cycle is over
+                			cycle_buf = multifocus->best_pending;
+                			multifocus->best_pending = NULL;
+                			multifocus->best_pending_sharpness = GST_MULTIFOCUS_SHARPNESS_NONE;
+                		}
+                		if (multifocus->predicted_plan == current_focus)
+                		{
+                			// Already commanded, the frames of this dwell are settled sooner
+                			enter_plan(multifocus, current_focus, plans_int[current_focus], predicted_lead);
+                		}
+                		else
                 		{
-                    			current_focus = 0;
+                			command_lens(multifocus, current_focus, plans_int[current_focus]);
                 		}
+                		multifocus->predicted_plan = -1;
+                		advance_cycle(multifocus);
             		}
+
+			// The frames keep showing the previous position for "latency" frames
+			// after a command, so the next plan is commanded that many frames
+			// before the end of the dwell
+			if (!multifocus->burst_active && !paused && lead > 0 && dwell_over(multifocus, buf, MIN(lead, multifocus->dwell_frames)) &&
+			    multifocus->cycle_length > 0 && current_focus != multifocus->frame_plan &&
+			    multifocus->predicted_plan != current_focus)
+			{
+				write_lens(multifocus, current_focus, plans_int[current_focus]);
+				multifocus->predicted_plan = current_focus;
+			}
+		}
+
+		settled = is_settled(multifocus, buf);
+		if (settled && !multifocus->settle_traced)
+		{
+			trace_lens(multifocus, "settled", multifocus->frame_plan, multifocus->frame_pda);
+			multifocus->settle_traced = true;
+		}
+		transitional = multifocus->frame_plan >= 0 && !settled;
+
+		if (selecting && settled && !multifocus->reset && multifocus->frame_plan >= 0)
+		{
+			multifocus->frame_sharpness = stage_sharpness(multifocus, pad, buf, multifocus->sweep_decimation);
+		}
+		if (multifocus->scene_change_threshold > 0 && multifocus->auto_detect_plans && !multifocus->reset &&
+		    !multifocus->calibrating && !multifocus->hysteresis_active && !bursting)
+		{
+			detect_scene_change(multifocus, buf, width, height);
 		}
+		if (multifocus->adaptive_dwell && settled && !multifocus->dwell_measured &&
+		    !multifocus->reset && !bursting && multifocus->frame_plan >= 0 && multifocus->frame_plan < MAX_PLANS)
+		{
+			// One measure per dwell is enough to follow the activity of the plans
+			if (multifocus->frame_sharpness == GST_MULTIFOCUS_SHARPNESS_NONE)
+				multifocus->frame_sharpness = stage_sharpness(multifocus, pad, buf, multifocus->sweep_decimation);
+			measure_plan_activity(multifocus, multifocus->frame_plan, multifocus->frame_sharpness);
+		}
+
+		if (!transitional || multifocus->transition_policy != TRANSITION_DROP)
+		{
+			buf = gst_buffer_make_writable(buf);
+			gst_buffer_add_multifocus_plan_meta(buf, multifocus->frame_plan, multifocus->frame_pda,
+			                                    multifocus->frames_since_switch, settled,
+			                                    multifocus->frame_sharpness);
+			if (multifocus->depth != NULL)
+			{
+				gst_buffer_add_multifocus_depth_meta(buf, multifocus->depth_columns, multifocus->depth_rows,
+				                                     multifocus->depth_tile, multifocus->depth,
+				                                     multifocus->depth_confidence);
+			}
+			if (transitional && multifocus->transition_policy == TRANSITION_MARK)
+			{
+				GST_BUFFER_FLAG_SET(buf, GST_BUFFER_FLAG_GAP | GST_BUFFER_FLAG_DROPPABLE);
+			}
+		}
+		multifocus->frames_since_switch++;
+
+		if (fusing && settled && !multifocus->reset && multifocus->frame_plan >= 0)
+		{
+			gst_buffer_replace(&multifocus->fusion_pending, buf);
+			multifocus->fusion_pending_plan = multifocus->frame_plan;
+		}
+		if (bursting && settled && multifocus->frame_plan == multifocus->burst_plan)
+		{
+			gst_buffer_list_add(multifocus->burst_list, gst_buffer_ref(buf));
+			multifocus->burst_plan++;
+			burst_done = multifocus->burst_plan >= multifocus->number_of_plans;
+		}
+		if (selecting && settled && !multifocus->reset && multifocus->frame_plan >= 0 &&
+		    multifocus->frame_sharpness > multifocus->best_pending_sharpness)
+		{
+			gst_buffer_replace(&multifocus->best_pending, buf);
+			multifocus->best_pending_sharpness = multifocus->frame_sharpness;
+		}
+
+		if (transitional && multifocus->transition_policy == TRANSITION_DROP)
+		{
+			frame++;
+			gst_caps_unref(caps);
+			// The frame completing the cycle comes before the hole, the flows are
+			// combined so that an error of the first push isn't lost
+			ret = GST_FLOW_OK;
+			if (cycle_buf != NULL)
+				ret = gst_multifocus_push(multifocus, cycle_buf, -1, TRUE);
+			ret = MIN(ret, gst_multifocus_drop_frame(multifocus, buf, !fusing && !selecting && !bursting));
+			if (burst_done)
+				ret = MIN(ret, gst_multifocus_push_burst(multifocus));
+			return ret;
+		}
+		route_plan = multifocus->frame_plan;
+	}
+	else
+	{
+		// The lens isn't driven, the frames are outside of any plan
+		buf = gst_buffer_make_writable(buf);
+		gst_buffer_add_multifocus_plan_meta(buf, -1, multifocus->frame_pda, multifocus->frames_since_switch,
+		                                    FALSE, multifocus->frame_sharpness);
 	}
 	frame++;
-    return gst_pad_push(multifocus->srcpad, buf);
+	gst_caps_unref(caps);
+
+	// In fused and best modes the src pad only gets one frame per cycle,
+	// during a burst it only gets the focal stack
+	ret = gst_multifocus_push(multifocus, buf, route_plan, !fusing && !selecting && !bursting);
+	if (cycle_buf != NULL)
+		ret = MIN(ret, gst_multifocus_push(multifocus, cycle_buf, -1, TRUE));
+	if (burst_done)
+		ret = MIN(ret, gst_multifocus_push_burst(multifocus));
+    return ret;
 }
 
 /* entry point to initialize the plug-in
@@ -665,16 +3304,49 @@ static gboolean multifocus_init(GstPlugin *multifocus)
                             0, "Template multifocus");
 
 
+#ifdef MULTIFOCUS_MOCK_LENS
+    // Test build on the simulated lens, see tests/mock
+    if (!gst_mock_lens_register(multifocus))
+        return FALSE;
+#endif
+
     return gst_element_register(multifocus, "multifocus", GST_RANK_NONE,
                                 GST_TYPE_multifocus);
 }
 
-static void gst_multifocus_finalize(void) // GObject *object)
+static void gst_multifocus_finalize(GObject *object)
 {
+    Gstmultifocus *multifocus = GST_multifocus(object);
+
     disable_VdacPda(devicepda, bus);
-    i2c_close(bus);
-    g_print("Bus closed\n");
+    if (bus >= 0)
+    {
+        i2c_close(bus);
+        GST_DEBUG_OBJECT(multifocus, "i2c bus closed");
+    }
     freeDebugInfo();
+
+    gst_flow_combiner_free(multifocus->flow_combiner);
+    free(multifocus->plans);
+    g_free(multifocus->cycle_sequence);
+    g_free(multifocus->plan_weights);
+    stats_thread_stop(multifocus);
+    g_free(multifocus->stats_file);
+    g_cond_clear(&multifocus->stats_cond);
+    ramp_end(multifocus);
+
+    output_reset(multifocus);
+    for (int i = 0; i < MAX_PLANS; i++)
+    {
+        g_free(multifocus->fusion_planes[i]);
+    }
+
+    if (multifocus->depth_acc_active)
+        depthMapFree(&multifocus->depth_acc);
+    gst_buffer_replace(&multifocus->depth, NULL);
+    gst_buffer_replace(&multifocus->depth_confidence, NULL);
+
+    G_OBJECT_CLASS(parent_class)->finalize(object);
 }
 
 /* PACKAGE: this is usually set by autotools depending on some _INIT macro
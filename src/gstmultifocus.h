@@ -47,6 +47,11 @@
 #define __GST_multifocus_H__
 
 #include <gst/gst.h>
+#include <gst/base/gstflowcombiner.h>
+#include <pthread.h>
+
+#include "depthFromFocus.h"
+#include "latencyStats.h"
 
 #include "multifocusControl.h"
 
@@ -64,6 +69,24 @@ G_BEGIN_DECLS
 #define GST_IS_multifocus_CLASS(klass) \
     (G_TYPE_CHECK_CLASS_TYPE((klass), GST_TYPE_multifocus))
 
+#define GST_TYPE_MULTIFOCUS_TRANSITION_POLICY \
+    (gst_multifocus_transition_policy_get_type())
+#define GST_TYPE_MULTIFOCUS_OUTPUT_MODE \
+    (gst_multifocus_output_mode_get_type())
+#define GST_TYPE_MULTIFOCUS_CYCLE_ORDER \
+    (gst_multifocus_cycle_order_get_type())
+#define GST_TYPE_MULTIFOCUS_SWEEP_MODE \
+    (gst_multifocus_sweep_mode_get_type())
+
+#define MAX_PLANS 50
+#define HYSTERESIS_STEPS 11     // Commands of the descending pass around the peak, 10 PDA apart
+#define SCENE_CHANGE_FRAMES 10  // Consecutive changed frames needed to start a new detection
+
+/* Names of the structures of the custom events controlling the element */
+#define GST_MULTIFOCUS_EVENT_GO_TO_PLAN "GstMultifocusGoToPlan"   // "plan" (int): plan to switch to
+#define GST_MULTIFOCUS_EVENT_REDETECT "GstMultifocusRedetect"     // Detect the plans again
+#define GST_MULTIFOCUS_EVENT_PAUSE "GstMultifocusPause"           // "paused" (boolean, default TRUE): stop cycling
+
 typedef struct _Gstmultifocus Gstmultifocus;
 typedef struct _GstmultifocusClass GstmultifocusClass;
 
@@ -74,6 +97,44 @@ typedef enum
     WAITING,
     COMPLETED
 } multifocusStatus;
+
+typedef enum
+{
+    TRANSITION_PASS,    // Push the frames taken while the lens is moving
+    TRANSITION_DROP,    // Drop them
+    TRANSITION_MARK     // Push them with the GAP and DROPPABLE flags
+} multifocusTransitionPolicy;
+
+typedef enum
+{
+    OUTPUT_ALL,         // Push every frame on the src pad
+    OUTPUT_FUSED,       // Push one all-in-focus frame per cycle of plans on the src pad
+    OUTPUT_BEST         // Push the sharpest settled frame of each cycle of plans on the src pad
+} multifocusOutputMode;
+
+typedef enum
+{
+    CYCLE_ARRAY,        // The plans in the order of the "plans" property
+    CYCLE_SORTED,       // The plans sorted by PDA
+    CYCLE_PING_PONG,    // The plans sorted by PDA, up then down
+    CYCLE_CUSTOM        // The plan indices of the "cycle-sequence" property
+} multifocusCycleOrder;
+
+typedef enum
+{
+    SWEEP_STEP,         // One PDA command per frame, sampled "latency" frames later
+    SWEEP_RAMP          // The lens moves continuously, each frame is mapped to its mid-exposure PDA
+} multifocusSweepMode;
+
+typedef enum
+{
+    STAGE_SETUP,        // Caps and ROI of the frame
+    STAGE_SHARPNESS,    // Each sharpness computation
+    STAGE_I2C,          // Each PDA command written to the lens
+    STAGE_PUSH,         // Each push downstream
+    STAGE_FRAME,        // The whole chain function
+    STAGE_COUNT
+} multifocusStage;
 int all_focus[50];
 int indice_next = 0;
 int frame = 0;
@@ -81,7 +142,7 @@ int step1 = 0;
 int step2 = 0;
 int current_focus = 0;
 int plans = 0;
-int sharpness_of_plans[100];
+int sharpness_of_plans[100];     // SHARPNESS_SKIPPED marks the samples dropped by the QoS throttling
 int start = 0;
 int searching_plans = 0;
 int i2c_err = 0;
@@ -104,15 +165,149 @@ struct _Gstmultifocus
     gboolean auto_detect_plans;
     gboolean next;
     gchar* plans;
-    
+
+    GstSegment segment;                 // Segment of the incoming stream, used to compute running times
+    gdouble qos_proportion;             // Last proportion reported by downstream QoS events
+    GstClockTime qos_earliest_time;     // Buffers with a running time before this one are late
+    gint analysis_budget_us;            // Time allowed to compute the sharpness of a frame, 0 to disable
+    gint64 full_analysis_us;            // Measured cost of the sharpness on the whole ROI, -1 if unknown
+    gint sweep_decimation;              // Sharpness decimation chosen for the current sweep
+    gint64 sweep_start_us;              // Monotonic time at which the current sweep started
+    gboolean last_sample_skipped;       // Never skip two samples in a row to keep the curve usable
+    guint skipped_samples;              // Number of samples skipped during the current sweep
+
+    gint frame_plan;                    // Plan of the last lens command, -1 outside of the plans
+    gint frame_pda;                     // Last PDA command sent to the lens
+    guint frames_since_switch;          // Frames seen since the last lens command
+    gint64 frame_sharpness;             // Sharpness computed on the current frame if any
+
+    multifocusTransitionPolicy transition_policy;
+    guint dropped_frames;               // Frames dropped by the TRANSITION_DROP policy
+
+    GstPad *plan_srcpads[MAX_PLANS];            // src_%u request pads, indexed by plan, protected by the object lock
+    GstClockTime plan_srcpads_next[MAX_PLANS];  // End of the last buffer pushed on each of them
+    GstFlowCombiner *flow_combiner;
+
+    multifocusOutputMode output_mode;
+    gboolean fusion_blend;              // Blend the planes weighted by their sharpness instead of picking the sharpest
+    gboolean fusion_format_warned;
+    GstBuffer *fusion_pending;          // Latest settled frame of the current plan
+    gint fusion_pending_plan;
+    guint8 *fusion_planes[MAX_PLANS];   // Copy of the last settled frame of each plan
+    gsize fusion_frame_size;
+    guint64 fusion_filled;              // Bit mask of the planes filled since the last fused frame
+    GstClockTime fusion_prev_pts;
+    GstBuffer *best_pending;            // Sharpest settled frame of the current cycle
+    gint64 best_pending_sharpness;
+
+    gint trigger_pending;               // Set by the "trigger" action, read atomically by the streaming thread
+    gboolean burst_active;              // A focal stack is being captured
+    gint burst_plan;                    // Plan whose settled frame is awaited
+    GstBufferList *burst_list;          // Frames of the focal stack captured so far
+
+    gint goto_plan;                     // Plan requested by a go-to-plan event, -1 if none, read atomically
+    gint redetect_pending;              // Set by a re-detect event, read atomically
+    gint cycle_paused;                  // Set by a pause event, the lens stays on the current plan
+
+    gboolean predictive_switch;         // Command the next plan "latency" frames before the end of the dwell
+    gint predicted_plan;                // Plan already commanded for the next dwell, -1 if none
+
+    gboolean calibrating;               // A lens latency calibration is running
+    gint calibration_step;
+    gint calibration_pda[2];            // The PDA before and after the step
+    long int calibration_before;        // The sharpness before the step
+    long int calibration_samples[CALIBRATION_WINDOW];
+    gint lens_delay;                    // Measured frames between a command and its first effect, -1 if not calibrated
+
+    gfloat sweep_peak;                  // PDA of the sharpest sample of the last sweep, refined between the samples
+    gboolean hysteresis_active;         // The descending pass measuring the hysteresis is running
+    gint hysteresis_step;
+    gint hysteresis_top;                // The first PDA of the descending pass
+    long int hysteresis_samples[HYSTERESIS_STEPS];
+
+    multifocusCycleOrder cycle_order;
+    gchar *cycle_sequence;              // Plan indices of the custom order, separated by ';'
+    gint cycle[2 * MAX_PLANS];          // Plans of a cycle in the order they are visited
+    gint cycle_length;                  // 0 when the cycle has to be built again
+    gint cycle_position;                // Position of current_focus in the cycle
+    guint switch_settle;                // Frames needed by the last move to settle
+
+    multifocusSweepMode sweep_mode;
+    gint ramp_duration_ms;
+    gint ramp_lag_ms;                   // Delay between a command and the lens showing it, -1 to use the calibrated delay
+    gboolean sweep_ramp;                // The sweep in progress is a ramp
+    pthread_t ramp_thread;              // Drives the lens along the ramp
+    gint ramp_stop;
+    GstClock *ramp_clock;
+    GstClockTime ramp_start;            // Clock time at which the lens leaves ramp_from
+    gint ramp_from;
+    gint ramp_to;
+    gint ramp_written;                  // Last PDA written by the ramp thread
+
+    guint64 dwell_time;                 // Time spent on each plan in nanoseconds, 0 to count "space-between-switch" frames
+    GstClockTime frame_duration;        // Nominal duration of a frame, from the buffers or the smallest PTS step
+    GstClockTime last_pts;
+    GstClockTime current_pts;           // PTS of the frame being processed
+    GstClockTime switch_pts;            // PTS at which the last command was sent
+    GstClockTime next_switch_pts;       // PTS at which the current dwell ends
+
+    guint64 last_offset;                // Offset of the previous buffer, the frame number for live sources
+    guint missing_frames;               // Frames dropped upstream right before the frame being processed
+    gint sweep_invalid_until;           // The sweep samples taken before this step can't be attributed to a PDA
+    gint resample[100];                 // Sweep samples to be measured again
+    gint resample_count;
+    gint resample_step;
+    gboolean resampling;
+
+    gchar *plan_weights;                // Static weight of each plan, separated by ';'
+    gdouble static_weights[MAX_PLANS];
+    gboolean adaptive_dwell;            // Scale the weights with the recent sharpness and activity of each plan
+    gdouble plan_level[MAX_PLANS];      // Average ROI sharpness of each plan, -1 until measured
+    gdouble plan_activity[MAX_PLANS];   // Average relative change of that sharpness between two visits
+    gint64 plan_last_sharpness[MAX_PLANS];
+    gboolean dwell_measured;            // The sharpness of the current dwell has been measured
+    gint next_switch_frame;             // Frame at which the current dwell ends, -1 to switch right away
+    guint dwell_frames;                 // Number of frames of the current dwell
+
+    gint scene_change_threshold;        // Fingerprint distance starting a new detection, 0 to disable
+    unsigned char scene_reference[SCENE_GRID * SCENE_GRID];   // Fingerprint of the scene the plans were detected on
+    gboolean scene_reference_valid;
+    guint scene_changed_frames;         // Number of consecutive frames away from the reference
+
+    LatencyHistogram stage_stats[STAGE_COUNT];  // Time spent in each stage, in microseconds
+    gchar *stats_file;                  // File the stats are appended to, NULL for none, guarded by the object lock
+    guint stats_interval;               // Milliseconds between two lines of the stats file, guarded by the object lock
+    pthread_t stats_thread;             // Writes the stats file, out of the streaming thread
+    gboolean stats_running;
+    gboolean stats_stop;                // Guarded by the object lock
+    GCond stats_cond;                   // Wakes the stats thread up to stop
+    gboolean settle_traced;             // The settling of the last command was given to the tracers
+
+    gboolean depth_map;                 // Build a depth map during the sweeps
+    gint depth_tile_size;
+    DepthMap depth_acc;                 // Depth map of the sweep in progress
+    gboolean depth_acc_active;
+    gint depth_stride;                  // Bytes between two lines of the GRAY8 frames of the sweep
+    GstBuffer *depth;                   // Depth map of the last sweep, attached to the following buffers
+    GstBuffer *depth_confidence;
+    guint depth_columns;
+    guint depth_rows;
+    guint depth_tile;
 };
 
 struct _GstmultifocusClass
 {
     GstElementClass parent_class;
+
+    /* actions */
+    void (*trigger)(Gstmultifocus *multifocus);
 };
 
 GType gst_multifocus_get_type(void);
+GType gst_multifocus_transition_policy_get_type(void);
+GType gst_multifocus_output_mode_get_type(void);
+GType gst_multifocus_cycle_order_get_type(void);
+GType gst_multifocus_sweep_mode_get_type(void);
 
 G_END_DECLS
 
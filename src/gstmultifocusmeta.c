@@ -0,0 +1,174 @@
+#include "gstmultifocusmeta.h"
+
+static gboolean gst_multifocus_plan_meta_init(GstMeta *meta, gpointer params, GstBuffer *buffer);
+static gboolean gst_multifocus_plan_meta_transform(GstBuffer *dest, GstMeta *meta, GstBuffer *buffer,
+                                                  GQuark type, gpointer data);
+static gboolean gst_multifocus_depth_meta_init(GstMeta *meta, gpointer params, GstBuffer *buffer);
+static void gst_multifocus_depth_meta_free(GstMeta *meta, GstBuffer *buffer);
+static gboolean gst_multifocus_depth_meta_transform(GstBuffer *dest, GstMeta *meta, GstBuffer *buffer,
+                                                   GQuark type, gpointer data);
+
+GType gst_multifocus_plan_meta_api_get_type(void)
+{
+    static GType type = 0;
+    static const gchar *tags[] = { NULL };  // The focus state doesn't depend on the content of the frame
+
+    if (g_once_init_enter(&type))
+    {
+        GType _type = gst_meta_api_type_register(GST_MULTIFOCUS_PLAN_META_API_NAME, tags);
+        g_once_init_leave(&type, _type);
+    }
+
+    return type;
+}
+
+static gboolean gst_multifocus_plan_meta_init(GstMeta *meta, gpointer params, GstBuffer *buffer)
+{
+    GstMultifocusPlanMeta *plan_meta = (GstMultifocusPlanMeta *)meta;
+
+    plan_meta->plan_index = -1;
+    plan_meta->pda = 0;
+    plan_meta->frames_since_switch = 0;
+    plan_meta->settled = FALSE;
+    plan_meta->sharpness = GST_MULTIFOCUS_SHARPNESS_NONE;
+
+    return TRUE;
+}
+
+static gboolean gst_multifocus_plan_meta_transform(GstBuffer *dest, GstMeta *meta, GstBuffer *buffer,
+                                                  GQuark type, gpointer data)
+{
+    GstMultifocusPlanMeta *plan_meta = (GstMultifocusPlanMeta *)meta;
+
+    // The frame is still the one taken at that focus whatever the transformation
+    return gst_buffer_add_multifocus_plan_meta(dest, plan_meta->plan_index, plan_meta->pda,
+                                               plan_meta->frames_since_switch, plan_meta->settled,
+                                               plan_meta->sharpness) != NULL;
+}
+
+const GstMetaInfo *gst_multifocus_plan_meta_get_info(void)
+{
+    static const GstMetaInfo *meta_info = NULL;
+
+    if (g_once_init_enter(&meta_info))
+    {
+        const GstMetaInfo *info = gst_meta_register(GST_MULTIFOCUS_PLAN_META_API_TYPE, "GstMultifocusPlanMeta",
+                                                    sizeof(GstMultifocusPlanMeta),
+                                                    gst_multifocus_plan_meta_init,
+                                                    (GstMetaFreeFunction)NULL,
+                                                    gst_multifocus_plan_meta_transform);
+        g_once_init_leave(&meta_info, info);
+    }
+
+    return meta_info;
+}
+
+GstMultifocusPlanMeta *gst_buffer_add_multifocus_plan_meta(GstBuffer *buffer, gint plan_index, gint pda,
+                                                           guint frames_since_switch, gboolean settled,
+                                                           gint64 sharpness)
+{
+    GstMultifocusPlanMeta *plan_meta;
+
+    g_return_val_if_fail(buffer != NULL, NULL);
+
+    plan_meta = (GstMultifocusPlanMeta *)gst_buffer_add_meta(buffer, GST_MULTIFOCUS_PLAN_META_INFO, NULL);
+    if (plan_meta == NULL)
+        return NULL;
+
+    plan_meta->plan_index = plan_index;
+    plan_meta->pda = pda;
+    plan_meta->frames_since_switch = frames_since_switch;
+    plan_meta->settled = settled;
+    plan_meta->sharpness = sharpness;
+
+    return plan_meta;
+}
+
+GType gst_multifocus_depth_meta_api_get_type(void)
+{
+    static GType type = 0;
+    static const gchar *tags[] = { NULL };
+
+    if (g_once_init_enter(&type))
+    {
+        GType _type = gst_meta_api_type_register(GST_MULTIFOCUS_DEPTH_META_API_NAME, tags);
+        g_once_init_leave(&type, _type);
+    }
+
+    return type;
+}
+
+static gboolean gst_multifocus_depth_meta_init(GstMeta *meta, gpointer params, GstBuffer *buffer)
+{
+    GstMultifocusDepthMeta *depth_meta = (GstMultifocusDepthMeta *)meta;
+
+    depth_meta->columns = 0;
+    depth_meta->rows = 0;
+    depth_meta->tile_size = 0;
+    depth_meta->depth = NULL;
+    depth_meta->confidence = NULL;
+
+    return TRUE;
+}
+
+static void gst_multifocus_depth_meta_free(GstMeta *meta, GstBuffer *buffer)
+{
+    GstMultifocusDepthMeta *depth_meta = (GstMultifocusDepthMeta *)meta;
+
+    gst_buffer_replace(&depth_meta->depth, NULL);
+    gst_buffer_replace(&depth_meta->confidence, NULL);
+}
+
+static gboolean gst_multifocus_depth_meta_transform(GstBuffer *dest, GstMeta *meta, GstBuffer *buffer,
+                                                   GQuark type, gpointer data)
+{
+    GstMultifocusDepthMeta *depth_meta = (GstMultifocusDepthMeta *)meta;
+
+    // The tiles are in the coordinates of the frame, a scaled or cropped frame loses the map
+    if (!GST_META_TRANSFORM_IS_COPY(type))
+        return FALSE;
+
+    // The map is read only, the copy shares it
+    return gst_buffer_add_multifocus_depth_meta(dest, depth_meta->columns, depth_meta->rows,
+                                                depth_meta->tile_size, depth_meta->depth,
+                                                depth_meta->confidence) != NULL;
+}
+
+const GstMetaInfo *gst_multifocus_depth_meta_get_info(void)
+{
+    static const GstMetaInfo *meta_info = NULL;
+
+    if (g_once_init_enter(&meta_info))
+    {
+        const GstMetaInfo *info = gst_meta_register(GST_MULTIFOCUS_DEPTH_META_API_TYPE, "GstMultifocusDepthMeta",
+                                                    sizeof(GstMultifocusDepthMeta),
+                                                    gst_multifocus_depth_meta_init,
+                                                    gst_multifocus_depth_meta_free,
+                                                    gst_multifocus_depth_meta_transform);
+        g_once_init_leave(&meta_info, info);
+    }
+
+    return meta_info;
+}
+
+GstMultifocusDepthMeta *gst_buffer_add_multifocus_depth_meta(GstBuffer *buffer, guint columns, guint rows,
+                                                             guint tile_size, GstBuffer *depth,
+                                                             GstBuffer *confidence)
+{
+    GstMultifocusDepthMeta *depth_meta;
+
+    g_return_val_if_fail(buffer != NULL, NULL);
+    g_return_val_if_fail(depth != NULL && confidence != NULL, NULL);
+
+    depth_meta = (GstMultifocusDepthMeta *)gst_buffer_add_meta(buffer, GST_MULTIFOCUS_DEPTH_META_INFO, NULL);
+    if (depth_meta == NULL)
+        return NULL;
+
+    depth_meta->columns = columns;
+    depth_meta->rows = rows;
+    depth_meta->tile_size = tile_size;
+    gst_buffer_replace(&depth_meta->depth, depth);
+    gst_buffer_replace(&depth_meta->confidence, confidence);
+
+    return depth_meta;
+}
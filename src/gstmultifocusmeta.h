@@ -0,0 +1,114 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_MULTIFOCUS_PLAN_META_API_TYPE (gst_multifocus_plan_meta_api_get_type())
+#define GST_MULTIFOCUS_PLAN_META_INFO (gst_multifocus_plan_meta_get_info())
+
+/* The get_type functions are private to the plugin, the header is installed
+ * for the elements downstream which find the metas by their API name */
+#define GST_MULTIFOCUS_PLAN_META_API_NAME "GstMultifocusPlanMetaAPI"
+
+#define GST_MULTIFOCUS_DEPTH_META_API_TYPE (gst_multifocus_depth_meta_api_get_type())
+#define GST_MULTIFOCUS_DEPTH_META_INFO (gst_multifocus_depth_meta_get_info())
+#define GST_MULTIFOCUS_DEPTH_META_API_NAME "GstMultifocusDepthMetaAPI"
+
+#define GST_MULTIFOCUS_SHARPNESS_NONE -1
+
+typedef struct _GstMultifocusPlanMeta GstMultifocusPlanMeta;
+typedef struct _GstMultifocusDepthMeta GstMultifocusDepthMeta;
+
+/**
+ * @brief Focus state of the lens when the frame went through the multifocus element
+ */
+struct _GstMultifocusPlanMeta
+{
+    GstMeta meta;
+
+    gint plan_index;            // Index of the plan in "plans", -1 while the plans are being searched
+    gint pda;                   // Last PDA command sent to the lens
+    guint frames_since_switch;  // Number of frames since that command was sent, 0 on the frame which sent it
+    gboolean settled;           // TRUE once frames_since_switch reached the "latency" property
+    gint64 sharpness;           // Sharpness computed on this frame, GST_MULTIFOCUS_SHARPNESS_NONE if it wasn't
+};
+
+GType gst_multifocus_plan_meta_api_get_type(void);
+const GstMetaInfo *gst_multifocus_plan_meta_get_info(void);
+
+/**
+ * @brief Attach the focus state of the lens to a buffer
+ *
+ * @param buffer A writable buffer
+ * @param plan_index The index of the plan, -1 if the frame wasn't taken on a plan
+ * @param pda The last PDA command sent to the lens
+ * @param frames_since_switch The number of frames since the command was sent
+ * @param settled Whether the lens is considered settled on this frame
+ * @param sharpness The sharpness of the frame or GST_MULTIFOCUS_SHARPNESS_NONE
+ * @return GstMultifocusPlanMeta* The meta added to the buffer
+ */
+GstMultifocusPlanMeta *gst_buffer_add_multifocus_plan_meta(GstBuffer *buffer, gint plan_index, gint pda,
+                                                           guint frames_since_switch, gboolean settled,
+                                                           gint64 sharpness);
+
+/**
+ * @brief Plan meta of a buffer, found by its API name so that it works without linking against the plugin
+ *
+ * @param buffer The buffer
+ * @return GstMultifocusPlanMeta* The meta, NULL if the buffer has none or the plugin isn't loaded
+ */
+static inline GstMultifocusPlanMeta *gst_buffer_get_multifocus_plan_meta(GstBuffer *buffer)
+{
+    GType api = g_type_from_name(GST_MULTIFOCUS_PLAN_META_API_NAME);
+
+    return (api != 0) ? (GstMultifocusPlanMeta *)gst_buffer_get_meta(buffer, api) : NULL;
+}
+
+/**
+ * @brief Depth from focus map measured during the last sweep of the lens
+ * The map is shared by all the buffers following the sweep, it must not be written
+ */
+struct _GstMultifocusDepthMeta
+{
+    GstMeta meta;
+
+    guint columns;              // Number of tiles on a line of the map
+    guint rows;                 // Number of lines of the map
+    guint tile_size;            // Size in pixels of the square tiles
+    GstBuffer *depth;           // columns * rows gint16, row major: PDA at which each tile is the sharpest
+    GstBuffer *confidence;      // columns * rows guint8, row major: 0 for a flat tile, 255 for a clear peak
+};
+
+GType gst_multifocus_depth_meta_api_get_type(void);
+const GstMetaInfo *gst_multifocus_depth_meta_get_info(void);
+
+/**
+ * @brief Attach a depth map to a buffer, the meta takes a reference on depth and confidence
+ *
+ * @param buffer A writable buffer
+ * @param columns The number of tiles on a line of the map
+ * @param rows The number of lines of the map
+ * @param tile_size The size in pixels of the tiles
+ * @param depth The PDA of each tile
+ * @param confidence The confidence of each tile
+ * @return GstMultifocusDepthMeta* The meta added to the buffer
+ */
+GstMultifocusDepthMeta *gst_buffer_add_multifocus_depth_meta(GstBuffer *buffer, guint columns, guint rows,
+                                                             guint tile_size, GstBuffer *depth,
+                                                             GstBuffer *confidence);
+
+/**
+ * @brief Depth meta of a buffer, found by its API name so that it works without linking against the plugin
+ *
+ * @param buffer The buffer
+ * @return GstMultifocusDepthMeta* The meta, NULL if the buffer has none or the plugin isn't loaded
+ */
+static inline GstMultifocusDepthMeta *gst_buffer_get_multifocus_depth_meta(GstBuffer *buffer)
+{
+    GType api = g_type_from_name(GST_MULTIFOCUS_DEPTH_META_API_NAME);
+
+    return (api != 0) ? (GstMultifocusDepthMeta *)gst_buffer_get_meta(buffer, api) : NULL;
+}
+
+G_END_DECLS
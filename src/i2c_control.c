@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <gst/gst.h>
 
 int i2cInit(I2CDevice *device, I2CDevice *devicepda, int *bus)
 {	
@@ -22,10 +23,10 @@ int i2cInit(I2CDevice *device, I2CDevice *devicepda, int *bus)
 	}
 	
 
-	printf("Bus %s open\n", bus_name);
+	GST_INFO("i2c bus %s open", bus_name);
 
 	/* Init i2c device */
-	printf("init device : \n");
+	GST_DEBUG("init device");
 	
 
 	initDevice(device, *bus, 0x3D, 256, 1);
@@ -89,7 +90,7 @@ int disable_VdacPda(I2CDevice device, int bus)
 		return(-3);
 	}
 
-	printf("Disable i2c pda\n");
+	GST_DEBUG("i2c pda disabled");
 
 	return 0;
 }
@@ -0,0 +1,90 @@
+#include "latencyStats.h"
+
+#include <string.h>
+#include <stdbool.h>
+
+/* Index of the bucket of a value: exact below LATENCY_EXACT, then
+ * LATENCY_SUB_BUCKETS buckets per power of two.
+ */
+static int bucketOf(uint64_t value)
+{
+    int msb;
+
+    if (value < LATENCY_EXACT)
+        return (int)value;
+    if (value > UINT32_MAX)
+        value = UINT32_MAX;
+
+    msb = 63 - __builtin_clzll(value);
+
+    return LATENCY_EXACT + ((msb - 4) * LATENCY_SUB_BUCKETS) + (int)((value >> (msb - 3)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+static uint64_t bucketUpperBound(int bucket)
+{
+    int msb, sub;
+
+    if (bucket < LATENCY_EXACT)
+        return bucket;
+
+    msb = 4 + (bucket - LATENCY_EXACT) / LATENCY_SUB_BUCKETS;
+    sub = (bucket - LATENCY_EXACT) % LATENCY_SUB_BUCKETS;
+
+    return ((uint64_t)(LATENCY_SUB_BUCKETS + sub + 1) << (msb - 3)) - 1;
+}
+
+void latencyRecord(LatencyHistogram *histogram, uint64_t value)
+{
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&histogram->counts[bucketOf(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+
+    while (value > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+uint64_t latencyPercentile(const LatencyHistogram *histogram, double percentile)
+{
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t count = 0;
+    uint64_t rank, seen = 0;
+
+    // The histogram may be updated meanwhile, work on a snapshot of the buckets
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        counts[i] = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        count += counts[i];
+    }
+
+    if (count == 0)
+        return 0;
+
+    rank = (uint64_t)((percentile / 100.0) * count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            uint64_t bound = bucketUpperBound(i);
+            uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+            return (bound < max) ? bound : max;
+        }
+    }
+
+    return __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
+
+void latencyReset(LatencyHistogram *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+}
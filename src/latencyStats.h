@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+#define LATENCY_EXACT 16            // Values below this one have a bucket of their own
+#define LATENCY_SUB_BUCKETS 8       // Buckets per power of two above LATENCY_EXACT
+#define LATENCY_BUCKETS (LATENCY_EXACT + (32 - 4) * LATENCY_SUB_BUCKETS)
+
+typedef struct latencyHistogram
+{
+    uint32_t counts[LATENCY_BUCKETS];   // Number of values in each bucket, at most 12.5% wide
+    uint64_t count;                     // Number of values recorded
+    uint64_t total;                     // Sum of the values recorded
+    uint64_t max;                       // Largest value recorded
+} LatencyHistogram;
+
+/**
+ * @brief Add a value to the histogram
+ * Lock free, it can be called from any thread
+ *
+ * @param histogram The histogram
+ * @param value The value, in microseconds for the stages of the element
+ */
+void latencyRecord(LatencyHistogram *histogram, uint64_t value);
+
+/**
+ * @brief Get a percentile of the values recorded
+ *
+ * @param histogram The histogram
+ * @param percentile The percentile, between 0 and 100
+ * @return uint64_t The upper bound of the bucket holding the percentile, 0 if nothing was recorded
+ */
+uint64_t latencyPercentile(const LatencyHistogram *histogram, double percentile);
+
+/**
+ * @brief Forget the values recorded
+ *
+ * @param histogram The histogram
+ */
+void latencyReset(LatencyHistogram *histogram);
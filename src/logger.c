@@ -2,142 +2,113 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
-Log *createNewEntry(char *message, size_t msgLen)
+#define LOG_LINE_SIZE 256
+
+static int64_t monotonicTime(void)
 {
-    Log *tmp = (Log*)malloc(sizeof(Log));
+    struct timespec now;
 
-    if (tmp == NULL)
-    {
-        printf("Error: unable to allocate new log entry into memory\n");
-    }
-    else
-    {
-        tmp->message = (char*)malloc(sizeof(char) * msgLen);
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-        if (tmp->message == NULL)
-        {
-            printf("Error: unable to allocate new message into memmory\n");
-            free(tmp);
-            tmp = NULL;
-        }
-        else
-        {
-            tmp->message = strcpy(tmp->message, message);
-            tmp->isValid = true;
-            tmp->next = NULL;
-        }
-    }
-
-    return tmp;
+    return ((int64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
 }
 
-void insert(List *list, char *message)
+void logRecord(LogRing *ring, int event, const long int *values)
 {
-    size_t msgLen = strlen(message);
-    if (list == NULL) return;
-
+    unsigned int index;
+    LogRecord *record;
 
+    if (ring == NULL) return;
 
-    if (list->head == NULL)
-    {
-        list->head = createNewEntry(message, msgLen);
-        list->len += msgLen;
-    }
-    else
-    {
-        Log *curr = list->head;
-        Log *prev = NULL;
+    // Each writer owns the slot it claimed, the sequence tells the reader when it is complete
+    index = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    record = &ring->records[index & (LOG_RING_SIZE - 1)];
 
-        while (curr != NULL && curr->isValid)
-        {
-            prev = curr;
-            curr = curr->next;
-        }
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-        if (curr != NULL)
-        {
-            curr->message = (char*)realloc(curr->message, sizeof(char) * msgLen);
+    record->timestamp = monotonicTime();
+    record->event = event;
+    memcpy(record->values, values, sizeof(record->values));
 
-            if (curr->message == NULL)
-            {
-                printf("Error: Unable to reallocate memory for the new message\n");
-            }
-            else
-            {
-                curr->message = strcpy(curr->message, message);
-                curr->isValid = true;
-                list->len += msgLen;
-            }
-        }
-        else
-        {
-            prev->next = createNewEntry(message, msgLen);
-            list->len += msgLen;
-        }
-    }
+    __atomic_store_n(&record->sequence, index + 1, __ATOMIC_RELEASE);
 }
 
-void freeList(List *list)
+void logReset(LogRing *ring)
 {
-    Log *curr = list->head;
-    Log *tmp = NULL;
-    if (list == NULL) return;
+    if (ring == NULL) return;
 
-    
-
-    while (curr != NULL)
-    {
-        tmp = curr->next;
-        free(curr->message);
-        free(curr);
-        curr = tmp;
-    }
-
-    list->len = 0;
+    __atomic_store_n(&ring->start, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
 }
 
-void invalidList(List *list)
+char *logToString(LogRing *ring, LogFormatter format, size_t *len)
 {
-    Log *curr = list->head;
-    if (list == NULL) return;
+    unsigned int head, first;
+    size_t capacity = 4096;
+    size_t used = 0;
+    char *fullLog;
 
+    if (ring == NULL) return NULL;
 
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    first = __atomic_load_n(&ring->start, __ATOMIC_ACQUIRE);
+    if (head - first > LOG_RING_SIZE)
+        first = head - LOG_RING_SIZE;
 
-    while (curr != NULL)
+    fullLog = (char*)malloc(capacity);
+    if (fullLog == NULL)
     {
-        curr->isValid = false;
-        curr = curr->next;
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return NULL;
     }
+    fullLog[0] = '\0';
 
-    list->len = 0;
-}
+    for (unsigned int index = first; index != head; index++)
+    {
+        const LogRecord *slot = &ring->records[index & (LOG_RING_SIZE - 1)];
+        LogRecord record;
+        char line[LOG_LINE_SIZE];
+        int lineLen;
+
+        // Copy the record, then make sure it wasn't rewritten meanwhile
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != index + 1)
+            continue;
+        memcpy(&record, slot, sizeof(record));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != index + 1)
+            continue;
+
+        lineLen = format(&record, line, sizeof(line));
+        if (lineLen <= 0)
+            continue;
+        if (lineLen >= LOG_LINE_SIZE)
+            lineLen = LOG_LINE_SIZE - 1;
+
+        if (used + lineLen + 1 > capacity)
+        {
+            char *tmp;
 
-char *getListStr(List *list)
-{
-    char *fullLog = (char*)malloc(sizeof(char) * (list->len + 1));
-    if (list == NULL) return NULL;
+            while (used + lineLen + 1 > capacity)
+                capacity *= 2;
 
+            tmp = (char*)realloc(fullLog, capacity);
+            if (tmp == NULL)
+            {
+                fprintf(stderr, "Error: Unable to reallocate memory for the log\n");
+                break;
+            }
+            fullLog = tmp;
+        }
 
-    
-    if (fullLog == NULL)
-    {
-        printf("Error: Unable to allocate memory\n");
+        memcpy(fullLog + used, line, lineLen);
+        used += lineLen;
+        fullLog[used] = '\0';
     }
-    else
-    {   
-        Log *curr = list->head;
-        fullLog[0] = '\0';
-
 
+    if (len != NULL)
+        *len = used;
 
-        while (curr != NULL && curr->isValid)
-        {
-            if (curr->message != NULL)
-                fullLog = strcat(fullLog, curr->message);
-            curr = curr->next;
-        }
-    }
-    
     return fullLog;
 }
@@ -2,48 +2,60 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
 
-typedef struct log
-{
-    char *message;
-    bool isValid;
-    struct log *next;
-} Log;
+#define LOG_RING_SIZE 4096     // Number of records kept, a power of two
+#define LOG_VALUES 4           // Number of values held by a record
 
-typedef struct list
+typedef struct logRecord
 {
-    Log *head;
-    size_t len;
-} List;
+    int64_t timestamp;          // Monotonic time of the record in microseconds
+    int event;                  // What happened, its meaning is up to the caller
+    long int values[LOG_VALUES];
+    unsigned int sequence;      // Index of the record + 1 once it is complete, 0 while it is written
+} LogRecord;
 
-Log *createNewEntry(char *message, size_t msgLen);
+typedef struct logRing
+{
+    LogRecord records[LOG_RING_SIZE];
+    unsigned int head;          // Index of the next record to be written
+    unsigned int start;         // Index of the first record since the last reset
+} LogRing;
 
 /**
- * @brief Insert a new message at the end of the list
- * 
- * @param list      The list
- * @param message   The message to append
+ * @brief Format a record as text
+ *
+ * @param record    The record
+ * @param out       The buffer receiving the text
+ * @param size      The size of the buffer
+ * @return int      The length of the text, as snprintf
  */
-void insert(List *list, char *message);
+typedef int (*LogFormatter)(const LogRecord *record, char *out, size_t size);
 
 /**
- * @brief Free the entire list
- * 
- * @param list  The list
+ * @brief Append a record to the ring, overwriting the oldest one when full
+ * Lock free and allocation free, it can be called from any thread
+ *
+ * @param ring      The ring
+ * @param event     What happened
+ * @param values    The LOG_VALUES values of the record
  */
-void freeList(List *list);
+void logRecord(LogRing *ring, int event, const long int *values);
 
 /**
- * @brief Mark each message as invalid to reuse the already allocated memory
- * 
- * @param list The list
+ * @brief Forget the records written so far
+ *
+ * @param ring The ring
  */
-void invalidList(List *list);
+void logReset(LogRing *ring);
 
 /**
- * @brief Get the list as a string
- * 
- * @param list      The list
- * @return char*    The string containing all log information
+ * @brief Get the records written since the last reset as a string, oldest first
+ * The records overwritten or still being written are skipped
+ *
+ * @param ring      The ring
+ * @param format    The function formatting each record
+ * @param len       Set to the length of the string if not NULL
+ * @return char*    The string to be freed, NULL on allocation failure
  */
-char *getListStr(List *list);
+char *logToString(LogRing *ring, LogFormatter format, size_t *len);
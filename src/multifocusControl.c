@@ -10,7 +10,72 @@ static multifocusConf currentConf;
 void logmultifocusInfo(int nbIter, long int sharpness);
 void goToPDA(I2CDevice *device, int bus, int pda);
 
-List debugInfo = { NULL, 0 };
+/* Events of the debug log, the values of each one are listed in formatDebugInfo() */
+typedef enum
+{
+    LOG_FRAME,
+    LOG_PHASE_COMPLETED,
+    LOG_PHASE1_BETTER,
+    LOG_PHASE_START,
+    LOG_FRAME_HEADER,
+    LOG_TIME
+} LogEvent;
+
+static LogRing debugInfo;
+LensModel lensModel = { false, 10, 0, -1, 0, false, false };
+
+/**
+ * @brief Format a record of the debug log the way it used to be printed
+ * 
+ * @param record The record
+ * @param out The buffer receiving the text
+ * @param size The size of the buffer
+ * @return int The length of the text
+ */
+static int formatDebugInfo(const LogRecord *record, char *out, size_t size)
+{
+    const long int *v = record->values;
+
+    switch (record->event)
+    {
+    case LOG_FRAME:
+        return snprintf(out, size, "%.2ld, %ld, %ld, %ld\n", v[0], v[1], v[2], v[3]);
+    case LOG_PHASE_COMPLETED:
+        return snprintf(out, size, "Phase %ld completed after %.2ld iterations\n\tThe best sharpness is %ld, at PDA %.3ld\n", v[0], v[1], v[2], v[3]);
+    case LOG_PHASE1_BETTER:
+        return snprintf(out, size, "Warning: the best focus was found durring the phase 1\n\tyou might need to recalibrate\n");
+    case LOG_PHASE_START:
+        return snprintf(out, size, "Phase %ld, PDA range [%.3ld, %.3ld], step = %.2ld\n", v[0], v[1], v[2], v[3]);
+    case LOG_FRAME_HEADER:
+        return snprintf(out, size, "Frame id, sharpness, sharpness pda, current pda\n");
+    case LOG_TIME:
+        return snprintf(out, size, "\tTook %.3f seconds\n", v[0] / 1000000.0);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Append a record to the debug log
+ * 
+ * @param event What happened
+ * @param v0 The values of the record, see formatDebugInfo()
+ * @param print Also print the record right away
+ */
+static void logDebugInfo(LogEvent event, long int v0, long int v1, long int v2, long int v3, bool print)
+{
+    LogRecord record = { 0, event, { v0, v1, v2, v3 }, 0 };
+
+    logRecord(&debugInfo, event, record.values);
+
+    if (print)
+    {
+        char tmp[256];
+
+        formatDebugInfo(&record, tmp, sizeof(tmp));
+        g_print("%s", tmp);
+    }
+}
 
 /**
  * @brief Log information about the current status of the multifocus
@@ -22,13 +87,11 @@ void logmultifocusInfo(int nbIter, long int sharpness)
 {
     if (currentConf.debugLvl >= FULL)
     {
-        char tmp[100];
         int effectivePda = currentConf.pdaValue - (currentConf.tmpOffset * currentConf.pdaStep);
         checkPDABounds(&effectivePda, currentConf.pdaMin, currentConf.pdaMax);
-            
-        sprintf(tmp, "%.2d, %ld, %d, %d\n", nbIter, (nbIter >= currentConf.offset) ? sharpness : -1, effectivePda, currentConf.pdaValue);
-        insert(&debugInfo, tmp);
-        g_print("%s", tmp);
+
+        // Formatted only when the log is read, the frame timing isn't affected
+        logDebugInfo(LOG_FRAME, nbIter, (nbIter >= currentConf.offset) ? sharpness : -1, effectivePda, currentConf.pdaValue, false);
     }
 }
 
@@ -37,10 +100,19 @@ void logmultifocusInfo(int nbIter, long int sharpness)
  * 
  * @param device The pda i2c device
  * @param bus The i2c bus
- * @param pda The pda command to be sent
+ * @param pda 0 to only send the lens to PDA 0, otherwise it goes on to the best PDA found
  */
 void goToPDA(I2CDevice *device, int bus, int pda)
 {
+    bool predictable = lensModel.uncertainty >= 0 && lensModel.uncertainty <= lensModel.tolerance;
+
+    if (lensModel.directMoves && predictable)
+    {
+        moveLens(device, bus, &lensModel, (pda != 0) ? currentConf.bestPdaValue : 0);
+        return;
+    }
+
+    // Approach the target from a fixed position so that it doesn't depend on the hysteresis
     write_VdacPda(*device, bus, 0);
 
     if (pda != 0)   // don't send the same command twice
@@ -48,6 +120,102 @@ void goToPDA(I2CDevice *device, int bus, int pda)
         usleep(10000);
         write_VdacPda(*device, bus, currentConf.bestPdaValue); // Send the PDA command to get the sharpest image
     }
+
+    lensModel.lastPda = (pda != 0) ? currentConf.bestPdaValue : 0;
+    lensModel.lastPdaKnown = true;
+}
+
+void moveLens(I2CDevice *device, int bus, LensModel *model, int pda)
+{
+    int command = pda;
+    bool downward = model->lastPdaKnown && pda < model->lastPda;
+
+    if (model->directMoves && downward && model->uncertainty >= 0 && model->uncertainty <= model->tolerance)
+        command += model->hysteresis;
+
+    write_VdacPda(*device, bus, command);
+
+    model->lastPda = pda;
+    model->lastPdaKnown = true;
+}
+
+void updateLensModel(LensModel *model, int hysteresis)
+{
+    int error = abs(hysteresis - model->hysteresis);
+
+    // A single measure can't be trusted, the model stays unknown until two
+    // consecutive measures agree within the tolerance
+    if (model->uncertainty < 0 && (!model->measured || error > model->tolerance))
+    {
+        model->hysteresis = hysteresis;
+        model->measured = true;
+        return;
+    }
+
+    model->uncertainty = error;
+    model->hysteresis = (model->hysteresis + hysteresis) / 2;
+}
+
+float refinePeak(long int left, long int center, long int right)
+{
+    long int curvature = left - 2 * center + right;
+    float offset;
+
+    if (curvature >= 0)
+        return 0;
+
+    offset = (float)(left - right) / (2 * curvature);
+
+    return (offset < -0.5f) ? -0.5f : (offset > 0.5f) ? 0.5f : offset;
+}
+
+void sceneFingerprint(const unsigned char *img, int width, int height, unsigned char *fingerprint)
+{
+    for (int cy = 0; cy < SCENE_GRID; cy++)
+    {
+        int y0 = (cy * height) / SCENE_GRID;
+        int y1 = ((cy + 1) * height) / SCENE_GRID;
+
+        for (int cx = 0; cx < SCENE_GRID; cx++)
+        {
+            int x0 = (cx * width) / SCENE_GRID;
+            int x1 = ((cx + 1) * width) / SCENE_GRID;
+            unsigned long sum = 0;
+            unsigned long count = 0;
+
+            // One pixel out of 4 in each direction is plenty for an average
+            for (int y = y0; y < y1; y += 4)
+            {
+                for (int x = x0; x < x1; x += 4)
+                {
+                    sum += img[(y * width) + x];
+                    count++;
+                }
+            }
+
+            fingerprint[(cy * SCENE_GRID) + cx] = (count > 0) ? sum / count : 0;
+        }
+    }
+}
+
+int fingerprintDistance(const unsigned char *a, const unsigned char *b)
+{
+    int cells = SCENE_GRID * SCENE_GRID;
+    int offset = 0;
+    int distance = 0;
+
+    for (int i = 0; i < cells; i++)
+    {
+        offset += a[i] - b[i];
+    }
+    offset /= cells;
+
+    for (int i = 0; i < cells; i++)
+    {
+        distance += abs(a[i] - b[i] - offset);
+    }
+
+    return distance / cells;
 }
 
 void checkPDABounds(int *pda, int pdaMin, int pdaMax)
@@ -68,45 +236,28 @@ void *unbiasedSharpnessMono(void *params)
     ROI threadRoi = parameters->threadsROI;
 
     int width = parameters->width;
+    int stride = 4 * parameters->decimation;
     int endX = threadRoi.x + threadRoi.width;
     int endY = threadRoi.y + threadRoi.height;
 
     long int tmpRes = 0;
     long int tmpAverage = 0;
 
-    for (int y = threadRoi.y; y < endY; y += 4)
+    for (int y = threadRoi.y; y < endY; y += stride)
     {
-        for (int x = threadRoi.x; x < endX; x += 4)
+        for (int x = threadRoi.x; x < endX; x += stride)
         {
-            int tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7, tmp8;
-
             int px0 = (y * width) + x;
             int px1 = px0 + width; //((y + 1) * width) + x;
             int px2 = px1 + width; //((y + 2) * width) + x;
             int px3 = px2 + width; //((y + 3) * width) + x;
 
-            tmp1 = (imgMat[px0]     - imgMat[px1]);
-            tmp2 = (imgMat[px0 + 1] - imgMat[px1 + 1]);
-            tmp3 = (imgMat[px2 + 2] - imgMat[px3 + 2]);
-            tmp4 = (imgMat[px2 + 3] - imgMat[px3 + 3]);
-            tmp5 = (imgMat[px0 + 2] - imgMat[px0 + 3]);
-            tmp6 = (imgMat[px1 + 2] - imgMat[px1 + 3]);
-            tmp7 = (imgMat[px2]     - imgMat[px2 + 1]);
-            tmp8 = (imgMat[px3]     - imgMat[px3 + 1]);
-
             tmpAverage += (imgMat[px0] * imgMat[px0]) + (imgMat[px0 + 1] * imgMat[px0 + 1]) + (imgMat[px0 + 2] * imgMat[px0 + 2]) + (imgMat[px0 + 3] * imgMat[px0 + 3]) +
                           (imgMat[px1] * imgMat[px1]) + (imgMat[px1 + 1] * imgMat[px1 + 1]) + (imgMat[px1 + 2] * imgMat[px1 + 2]) + (imgMat[px1 + 3] * imgMat[px1 + 3]) +
                           (imgMat[px2] * imgMat[px2]) + (imgMat[px2 + 1] * imgMat[px2 + 1]) + (imgMat[px2 + 2] * imgMat[px2 + 2]) + (imgMat[px2 + 3] * imgMat[px2 + 3]) +
                           (imgMat[px3] * imgMat[px3]) + (imgMat[px3 + 1] * imgMat[px3 + 1]) + (imgMat[px3 + 2] * imgMat[px3 + 2]) + (imgMat[px3 + 3] * imgMat[px3 + 3]);
 
-            tmpRes += tmp1 * tmp1;
-            tmpRes += tmp2 * tmp2;
-            tmpRes += tmp3 * tmp3;
-            tmpRes += tmp4 * tmp4;
-            tmpRes += tmp5 * tmp5;
-            tmpRes += tmp6 * tmp6;
-            tmpRes += tmp7 * tmp7;
-            tmpRes += tmp8 * tmp8;
+            tmpRes += blockGradientEnergy(imgMat, px0, width);
         }
     }
 
@@ -116,7 +267,27 @@ void *unbiasedSharpnessMono(void *params)
     pthread_exit(NULL);
 }
 
+long int tileGradientEnergy(const unsigned char *imgMat, int stride, int x0, int y0, int x1, int y1)
+{
+    long int energy = 0;
+
+    for (int y = y0; y + 4 <= y1; y += 4)
+    {
+        for (int x = x0; x + 4 <= x1; x += 4)
+        {
+            energy += blockGradientEnergy(imgMat, (y * stride) + x, stride);
+        }
+    }
+
+    return energy;
+}
+
 long int unbiasedSharpnessThread(guint8 *imgMat, int width, ROI roi)
+{
+    return unbiasedSharpnessDecimated(imgMat, width, roi, 1);
+}
+
+long int unbiasedSharpnessDecimated(guint8 *imgMat, int width, ROI roi, int decimation)
 {
     long int finalResult = 0;
     long int finalAverage = 0;
@@ -135,6 +306,7 @@ long int unbiasedSharpnessThread(guint8 *imgMat, int width, ROI roi)
 
         params[i].imgMat  = imgMat;
         params[i].width   = width;
+        params[i].decimation = decimation;
         params[i].result  = 0;
         params[i].average = 0;
 
@@ -149,13 +321,20 @@ long int unbiasedSharpnessThread(guint8 *imgMat, int width, ROI roi)
         finalAverage += params[i].average;
     }
 
+    // Only one block out of decimation^2 was visited, extrapolate both sums to the whole ROI
+    finalResult  *= decimation * decimation;
+    finalAverage *= decimation * decimation;
+
     n = roi.width * roi.height;
     finalAverage = finalAverage / n;
 
+    if (finalAverage == 0) // black frame, there is nothing to measure
+        return 0;
+
     return finalResult / finalAverage;
 }
 
-long int getSharpness(GstPad *pad, GstBuffer *buf, ROI roi)
+long int getSharpness(GstPad *pad, GstBuffer *buf, ROI roi, int decimation)
 {
     GstMapInfo map;
 
@@ -170,14 +349,16 @@ long int sharp;
     // we need to get the final caps on the buffer to get the size
     res = gst_structure_get_int(s, "width", &width);
     res |= gst_structure_get_int(s, "height", &height);
+    gst_caps_unref(caps);
 
     if (!res)
     {
-        g_print("could not get snapshot dimension\n");
+        GST_WARNING("could not get snapshot dimension");
+        gst_buffer_unmap(buf, &map);
         return -1;
     }
 
-    sharp = unbiasedSharpnessThread(map.data, width, roi);
+    sharp = unbiasedSharpnessDecimated(map.data, width, roi, decimation);
 
     /*for (int y = roi.y; y < roi.y + roi.height - 1; y++)
     {
@@ -257,10 +438,7 @@ long int naivemultifocus(I2CDevice *device, int bus, long int sharpness)
 
         if (currentConf.debugLvl >= MINIMAL)
         {
-            char tmp[128];
-            sprintf(tmp, "Phase %d completed after %.2d iterations\n\tThe best sharpness is %ld, at PDA %.3d\n", currentConf.phase, nbIter, maxSharpness, currentConf.bestPdaValue);
-            g_print("%s", tmp);
-            insert(&debugInfo, tmp);
+            logDebugInfo(LOG_PHASE_COMPLETED, currentConf.phase, nbIter, maxSharpness, currentConf.bestPdaValue, true);
         }
 
         res = maxSharpness;
@@ -311,9 +489,7 @@ long int twoPhasemultifocus(I2CDevice *device, int bus, long int sharpness)
         {
             if (res < maxSharpness)
             {
-                char tmp[] = "Warning: the best focus was found durring the phase 1\n\tyou might need to recalibrate\n";
-                g_print("%s", tmp);
-                insert(&debugInfo, tmp);
+                logDebugInfo(LOG_PHASE1_BETTER, 0, 0, 0, 0, true);
 
                 goToPDA(device, bus, bestPdaValue);
             }
@@ -332,11 +508,10 @@ void resetmultifocus(multifocusStrategy strat, multifocusConf *conf, I2CDevice *
 {
     if (conf == NULL)
     {
-        g_print("Error: conf is null\n");
+        GST_WARNING("conf is null");
     }
     else
     {
-	char tmp[128];
         currentConf.debugLvl = conf->debugLvl;
         currentConf.bestPdaValue = 0;
         currentConf.pdaValue = conf->pdaMin;
@@ -355,48 +530,82 @@ void resetmultifocus(multifocusStrategy strat, multifocusConf *conf, I2CDevice *
         
         if (currentConf.debugLvl >= MINIMAL)
         {
-            
-            sprintf(tmp, "Phase %d, PDA range [%.3d, %.3d], step = %.2d\n", conf->phase, conf->pdaMin, conf->pdaMax, currentConf.pdaStep);
-            insert(&debugInfo, tmp);
-            g_print("%s", tmp);
+            logDebugInfo(LOG_PHASE_START, conf->phase, conf->pdaMin, conf->pdaMax, currentConf.pdaStep, true);
         }
         
         if (currentConf.debugLvl >= FULL)
         {
-            sprintf(tmp, "Frame id, sharpness, sharpness pda, current pda\n");
-            insert(&debugInfo, tmp);
-            g_print("%s", tmp);
+            logDebugInfo(LOG_FRAME_HEADER, 0, 0, 0, 0, true);
         }    
     }
 
     goToPDA(device, bus, currentConf.pdaMin);
 }
 
+int measureLensResponse(const long int *samples, int count, long int before, int *delay, int *settle)
+{
+    long int after = 0;
+    long int change;
+    int tail = (count < 5) ? count : 5;
+
+    if (count <= 0)
+        return -1;
+
+    // The last frames of the window give the sharpness at the new PDA
+    for (int i = count - tail; i < count; i++)
+    {
+        after += samples[i];
+    }
+    after /= tail;
+
+    change = labs(after - before);
+    if (change * 20 < MAX(labs(after), labs(before)))
+        return -1;
+
+    *delay = count;
+    for (int i = 0; i < count; i++)
+    {
+        if (labs(samples[i] - before) * 5 > change)
+        {
+            *delay = i;
+            break;
+        }
+    }
+
+    *settle = count;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        if (labs(samples[i] - after) * 10 > change)
+            break;
+        *settle = i;
+    }
+
+    if (*settle < *delay)
+        *settle = *delay;
+
+    return 0;
+}
+
 void resetDebugInfo(void)
 {
-    invalidList(&debugInfo);
+    logReset(&debugInfo);
 }
 
 void freeDebugInfo(void)
 {
-    freeList(&debugInfo);
+    // The ring is never allocated, emptying it is enough
+    logReset(&debugInfo);
 }
 
 char *getDebugInfo(size_t *len)
 {
-    if (len != NULL)
-        *len = debugInfo.len;
-    
-    return getListStr(&debugInfo);
+    return logToString(&debugInfo, formatDebugInfo, len);
 }
 
 void logmultifocusTime(double time)
 {
     if (currentConf.debugLvl >= MINIMAL)
     {
-        char tmp[25];
-        sprintf(tmp, "\tTook %.3f seconds\n", time);
-        insert(&debugInfo, tmp);
-        g_print("%s", tmp);
+        logDebugInfo(LOG_TIME, (long int)(time * 1000000), 0, 0, 0, true);
     }
 }
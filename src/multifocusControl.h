@@ -8,6 +8,13 @@
 
 #define NB_THREADS 2
 
+#define MAX_DECIMATION 8    // Coarsest block stride used when the analysis must be throttled
+
+#define CALIBRATION_HOLD 15     // Frames spent on the first PDA before the step
+#define CALIBRATION_WINDOW 40   // Frames watched after the step
+
+#define SCENE_GRID 8            // Number of cells per side of the scene fingerprint
+
 typedef enum
 {
     NONE,
@@ -38,6 +45,7 @@ typedef struct sharpnessParameters
     unsigned char *imgMat;  // The frame data
     ROI threadsROI;         // The ROI to be processed
     int width;              // The width of the whole frame 
+    int decimation;         // Only one 4x4 block out of decimation is visited in each direction
     long int result;        // The sharpness value
     long int average;       // The average of the pixels on the ROI
 } SharpnessParameters;
@@ -59,6 +67,60 @@ typedef struct multifocusConf
     int tmpOffset;
 } multifocusConf;
 
+typedef struct lensModel
+{
+    bool directMoves;   // Move straight to the corrected target instead of approaching it from PDA 0
+    int tolerance;      // Largest predicted error allowed for a direct move
+    int hysteresis;     // PDA to add to a target approached from above to land where it lands when approached from below
+    int uncertainty;    // Predicted error of the corrected target, -1 while the hysteresis wasn't measured
+    int lastPda;        // The last PDA sent to the lens
+    bool lastPdaKnown;
+    bool measured;      // Whether hysteresis holds a measure, waiting for a second one to agree with it
+} LensModel;
+
+extern LensModel lensModel;
+
+/**
+ * @brief Gradient energy of the 4x4 block whose top left pixel is px0
+ * This is the metric shared by all the sharpness computations
+ * 
+ * @param imgMat The frame data
+ * @param px0 The index of the top left pixel of the block
+ * @param width The width of the frame
+ * @return int The sum of the squared differences between the pixels of the block
+ */
+static inline int blockGradientEnergy(const unsigned char *imgMat, int px0, int width)
+{
+    int px1 = px0 + width;
+    int px2 = px1 + width;
+    int px3 = px2 + width;
+
+    int tmp1 = (imgMat[px0]     - imgMat[px1]);
+    int tmp2 = (imgMat[px0 + 1] - imgMat[px1 + 1]);
+    int tmp3 = (imgMat[px2 + 2] - imgMat[px3 + 2]);
+    int tmp4 = (imgMat[px2 + 3] - imgMat[px3 + 3]);
+    int tmp5 = (imgMat[px0 + 2] - imgMat[px0 + 3]);
+    int tmp6 = (imgMat[px1 + 2] - imgMat[px1 + 3]);
+    int tmp7 = (imgMat[px2]     - imgMat[px2 + 1]);
+    int tmp8 = (imgMat[px3]     - imgMat[px3 + 1]);
+
+    return tmp1 * tmp1 + tmp2 * tmp2 + tmp3 * tmp3 + tmp4 * tmp4 +
+           tmp5 * tmp5 + tmp6 * tmp6 + tmp7 * tmp7 + tmp8 * tmp8;
+}
+
+/**
+ * @brief Gradient energy of a rectangle of the frame, only the 4x4 blocks lying entirely inside it are measured
+ * 
+ * @param imgMat The frame data
+ * @param stride The number of bytes between two lines of the frame
+ * @param x0 The first column of the rectangle
+ * @param y0 The first line of the rectangle
+ * @param x1 The column following the last one of the rectangle
+ * @param y1 The line following the last one of the rectangle
+ * @return long int The sum of the gradient energies of the blocks
+ */
+long int tileGradientEnergy(const unsigned char *imgMat, int stride, int x0, int y0, int x1, int y1);
+
 /**
  * @brief Compute the sharpness on a section of the image
  * 
@@ -77,15 +139,28 @@ void *unbiasedSharpnessMono(void *params);
  */
 long int unbiasedSharpnessThread(guint8 *imgMat, int width, ROI roi);
 
+/**
+ * @brief Multi thread the sharpness computation of the frame on a subset of the ROI
+ * The result is scaled back to the full ROI so it stays comparable with unbiasedSharpnessThread
+ * 
+ * @param imgMat The frame data
+ * @param width The width of the frame
+ * @param roi The ROI where to compute the sharpness
+ * @param decimation Stride between the visited 4x4 blocks, 1 visits the whole ROI
+ * @return long int The sharpness of the image normalized by the average of the pixels
+ */
+long int unbiasedSharpnessDecimated(guint8 *imgMat, int width, ROI roi, int decimation);
+
 /**
  * @brief Get the Sharpness from a frame
  * 
  * @param pad The gstreamer pad
  * @param buf The gstreamer buffer
  * @param roi The ROI where to compute the sharpness 
+ * @param decimation Stride between the visited 4x4 blocks, 1 visits the whole ROI
  * @return long int The sharpness value of the frame
  */
-long int getSharpness(GstPad *pad, GstBuffer *buf, ROI roi);
+long int getSharpness(GstPad *pad, GstBuffer *buf, ROI roi, int decimation);
 
 void naivePDAStepHandler(I2CDevice *device, int bus, int dec, int nbIter);
 
@@ -122,6 +197,56 @@ long int twoPhasemultifocus(I2CDevice *device, int bus, long int sharpness);
  */
 void resetmultifocus(multifocusStrategy strat, multifocusConf *conf, I2CDevice *device, int bus);
 
+/**
+ * @brief Send a PDA command to the lens, corrected for the hysteresis when the target is approached from above
+ * and the model predicts an error within tolerance
+ * 
+ * @param device The i2c device of the lens
+ * @param bus    The i2c bus
+ * @param model  The LensModel structure
+ * @param pda    The target PDA, as found by an increasing sweep
+ */
+void moveLens(I2CDevice *device, int bus, LensModel *model, int pda);
+
+/**
+ * @brief Add a measure of the hysteresis to the lens model
+ * The uncertainty stays unknown until two consecutive measures agree within the tolerance
+ * 
+ * @param model The LensModel structure
+ * @param hysteresis The PDA of the sharpest position approached from above minus the one approached from below
+ */
+void updateLensModel(LensModel *model, int hysteresis);
+
+/**
+ * @brief Refine the position of a peak with a parabola through the sample and its two neighbours
+ * 
+ * @param left The sample before the peak
+ * @param center The peak sample
+ * @param right The sample after the peak
+ * @return float The offset of the peak from the center sample, between -0.5 and 0.5
+ */
+float refinePeak(long int left, long int center, long int right);
+
+/**
+ * @brief Reduce a frame to the average luminance of a SCENE_GRID x SCENE_GRID grid of cells
+ * The grid barely changes with the focus, only with the content of the scene
+ * 
+ * @param img The frame, GRAY8
+ * @param width The width of the frame
+ * @param height The height of the frame
+ * @param fingerprint The SCENE_GRID * SCENE_GRID averages
+ */
+void sceneFingerprint(const unsigned char *img, int width, int height, unsigned char *fingerprint);
+
+/**
+ * @brief Compare two scene fingerprints, ignoring a global change of brightness
+ * 
+ * @param a The first fingerprint
+ * @param b The second fingerprint
+ * @return int The mean absolute difference of the cells in grey levels
+ */
+int fingerprintDistance(const unsigned char *a, const unsigned char *b);
+
 /**
  * @brief Check if the pda is in the allowed pda range
  * otherwise snap it back into the range
@@ -132,6 +257,18 @@ void resetmultifocus(multifocusStrategy strat, multifocusConf *conf, I2CDevice *
  */
 void checkPDABounds(int *pda, int pdaMin, int pdaMax);
 
+/**
+ * @brief Measure the response of the lens to a step of PDA from the sharpness of the following frames
+ * 
+ * @param samples The sharpness of the frames, samples[0] being the frame on which the step was commanded
+ * @param count The number of samples
+ * @param before The sharpness before the step
+ * @param delay The number of frames before the sharpness starts to change
+ * @param settle The number of frames before the sharpness stays within 10% of its final value
+ * @return int 0 on success, -1 if the step didn't change the sharpness enough to be measured
+ */
+int measureLensResponse(const long int *samples, int count, long int before, int *delay, int *settle);
+
 /**
  * @brief Empty the debug info log
  * 
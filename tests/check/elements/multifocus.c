@@ -0,0 +1,156 @@
+/*
+ * Checks of the plan detection with the test build of the plugin, whose lens
+ * is simulated by mockLens.h, run headless without the I2C bus: the element
+ * is fed through "mocklens" with a checkerboard whose two halves are in focus
+ * at known PDA, and the detection must find them within a fixed number of
+ * frames.
+ *
+ * The timings are measured by bench-pipeline, not here.
+ */
+
+#include <string.h>
+#include <gst/gst.h>
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+
+#define WIDTH 320
+#define HEIGHT 240
+#define MAX_FRAMES 300
+#define FOCUS_LEFT -50
+#define FOCUS_RIGHT 350
+#define MOCK_FOCUS "-50;350"    // FOCUS_LEFT and FOCUS_RIGHT, the left and right halves of the frame
+#define MAX_ERROR 20            // Two steps of the sweep
+#define MIN_SWEEP_FRAMES 80     // The 80 steps of the sweep
+#define MAX_SWEEP_FRAMES 110    // The wait after start, the steps and the lens latency
+
+typedef struct detection
+{
+    int frames;                 // Frames pushed when the detection was posted, 0 if none
+    int plans[8];
+    int nbPlans;
+} Detection;
+
+static GstBuffer *checkerFrame(void)
+{
+    GstBuffer *buf = gst_buffer_new_allocate(NULL, WIDTH * HEIGHT, NULL);
+    GstMapInfo map;
+
+    gst_buffer_map(buf, &map, GST_MAP_WRITE);
+    for (int y = 0; y < HEIGHT; y++)
+    {
+        for (int x = 0; x < WIDTH; x++)
+        {
+            map.data[(y * WIDTH) + x] = (((x / 8) + (y / 8)) & 1) ? 200 : 50;
+        }
+    }
+    gst_buffer_unmap(buf, &map);
+
+    return buf;
+}
+
+/* Push frames until the first "multifocus-detection" message */
+static void runDetection(Detection *detection)
+{
+    GstHarness *h;
+    GstElement *multifocus;
+    GstBus *bus = gst_bus_new();
+    GstBuffer *frame;
+
+    memset(detection, 0, sizeof(*detection));
+
+    // The mock lens blurs the frames by the PDA written by multifocus
+    h = gst_harness_new_parse("mocklens ! multifocus name=mf");
+    gst_element_set_bus(h->element, bus);
+    multifocus = gst_bin_get_by_name(GST_BIN(h->element), "mf");
+    g_object_set(multifocus, "reset", TRUE, "number-of-plans", 2, NULL);
+    gst_object_unref(multifocus);
+    gst_harness_set_src_caps_str(h, "video/x-raw,format=GRAY8,width=320,height=240,framerate=30/1");
+
+    frame = checkerFrame();
+    for (int i = 1; i <= MAX_FRAMES && detection->frames == 0; i++)
+    {
+        GstMessage *message;
+
+        fail_unless_equals_int(gst_harness_push(h, gst_buffer_copy_deep(frame)), GST_FLOW_OK);
+
+        // Posted from the chain function, so it is there once the push returns
+        while ((message = gst_bus_pop_filtered(bus, GST_MESSAGE_ELEMENT)) != NULL)
+        {
+            const GstStructure *s = gst_message_get_structure(message);
+
+            if (detection->frames == 0 && gst_structure_has_name(s, "multifocus-detection"))
+            {
+                const GValue *plans = gst_structure_get_value(s, "plans");
+
+                detection->frames = i;
+                for (guint j = 0; j < gst_value_array_get_size(plans) && detection->nbPlans < 8; j++)
+                {
+                    detection->plans[detection->nbPlans++] = g_value_get_int(gst_value_array_get_value(plans, j));
+                }
+            }
+            gst_message_unref(message);
+        }
+    }
+
+    gst_buffer_unref(frame);
+    gst_element_set_bus(h->element, NULL);
+    gst_object_unref(bus);
+    gst_harness_teardown(h);
+}
+
+static int closestPlan(const Detection *detection, int pda)
+{
+    int best = G_MAXINT;
+
+    for (int i = 0; i < detection->nbPlans; i++)
+    {
+        best = MIN(best, ABS(detection->plans[i] - pda));
+    }
+
+    return best;
+}
+
+GST_START_TEST(test_detection_accuracy)
+{
+    Detection detection;
+
+    runDetection(&detection);
+
+    fail_unless(detection.frames > 0, "no detection after %d frames", MAX_FRAMES);
+    fail_unless_equals_int(detection.nbPlans, 2);
+    fail_unless(closestPlan(&detection, FOCUS_LEFT) <= MAX_ERROR,
+                "no plan near PDA %d, found %d and %d", FOCUS_LEFT, detection.plans[0], detection.plans[1]);
+    fail_unless(closestPlan(&detection, FOCUS_RIGHT) <= MAX_ERROR,
+                "no plan near PDA %d, found %d and %d", FOCUS_RIGHT, detection.plans[0], detection.plans[1]);
+}
+GST_END_TEST;
+
+GST_START_TEST(test_sweep_length)
+{
+    Detection detection;
+
+    runDetection(&detection);
+
+    fail_unless(detection.frames >= MIN_SWEEP_FRAMES && detection.frames <= MAX_SWEEP_FRAMES,
+                "detection after %d frames, expected %d to %d", detection.frames, MIN_SWEEP_FRAMES, MAX_SWEEP_FRAMES);
+}
+GST_END_TEST;
+
+static Suite *multifocus_suite(void)
+{
+    Suite *s = suite_create("multifocus");
+    TCase *tc = tcase_create("detection");
+
+    // Read by the mock lens on its first use
+    g_setenv("MULTIFOCUS_MOCK_DELAY", "3", TRUE);
+    g_setenv("MULTIFOCUS_MOCK_FOCUS", MOCK_FOCUS, TRUE);
+
+    tcase_set_timeout(tc, 60);
+    suite_add_tcase(s, tc);
+    tcase_add_test(tc, test_detection_accuracy);
+    tcase_add_test(tc, test_sweep_length);
+
+    return s;
+}
+
+GST_CHECK_MAIN(multifocus);
@@ -0,0 +1,87 @@
+/*
+ * "mocklens" element of the test build of the plugin: each frame going
+ * through is blurred by the distance between the PDA the simulated lens
+ * shows and the focus of each band of the scene, see mockLens.h.
+ *
+ *   videotestsrc ! video/x-raw,format=GRAY8 ! mocklens ! multifocus ! fakesink
+ *
+ * It stands for the optics and the sensor, in the same streaming thread
+ * right before multifocus so that the lens delay counts in frames.
+ */
+
+#include "gstmocklens.h"
+#include "mockLens.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_mock_lens_debug);
+#define GST_CAT_DEFAULT gst_mock_lens_debug
+
+static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE("sink",
+                                                                   GST_PAD_SINK,
+                                                                   GST_PAD_ALWAYS,
+                                                                   GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("GRAY8")));
+
+static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE("src",
+                                                                  GST_PAD_SRC,
+                                                                  GST_PAD_ALWAYS,
+                                                                  GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("GRAY8")));
+
+#define gst_mock_lens_parent_class parent_class
+G_DEFINE_TYPE(GstMockLens, gst_mock_lens, GST_TYPE_BASE_TRANSFORM)
+
+static gboolean gst_mock_lens_set_caps(GstBaseTransform *trans, GstCaps *incaps, GstCaps *outcaps)
+{
+    GstMockLens *lens = GST_MOCK_LENS(trans);
+
+    return gst_video_info_from_caps(&lens->info, incaps);
+}
+
+static GstFlowReturn gst_mock_lens_transform_ip(GstBaseTransform *trans, GstBuffer *buf)
+{
+    GstMockLens *lens = GST_MOCK_LENS(trans);
+    gint width = GST_VIDEO_INFO_WIDTH(&lens->info);
+    gint height = GST_VIDEO_INFO_HEIGHT(&lens->info);
+    gint stride = GST_VIDEO_INFO_PLANE_STRIDE(&lens->info, 0);
+    GstMapInfo map;
+
+    if (!gst_buffer_map(buf, &map, GST_MAP_READWRITE))
+    {
+        GST_WARNING_OBJECT(lens, "unable to map the frame");
+        return GST_FLOW_ERROR;
+    }
+    if (map.size >= (gsize)stride * height)
+        mockLensFrame(map.data, width, height, stride);
+    gst_buffer_unmap(buf, &map);
+
+    return GST_FLOW_OK;
+}
+
+static void gst_mock_lens_class_init(GstMockLensClass *klass)
+{
+    GstElementClass *gstelement_class = (GstElementClass *)klass;
+    GstBaseTransformClass *trans_class = (GstBaseTransformClass *)klass;
+
+    gst_element_class_set_static_metadata(gstelement_class,
+                                          "Mock lens",
+                                          "Filter/Effect/Video",
+                                          "Blurs the frames as the simulated lens of the multifocus tests would",
+                                          "Teledyne e2V");
+    gst_element_class_add_pad_template(gstelement_class,
+                                       gst_static_pad_template_get(&src_factory));
+    gst_element_class_add_pad_template(gstelement_class,
+                                       gst_static_pad_template_get(&sink_factory));
+
+    trans_class->set_caps = GST_DEBUG_FUNCPTR(gst_mock_lens_set_caps);
+    trans_class->transform_ip = GST_DEBUG_FUNCPTR(gst_mock_lens_transform_ip);
+}
+
+static void gst_mock_lens_init(GstMockLens *lens)
+{
+    gst_video_info_init(&lens->info);
+}
+
+gboolean gst_mock_lens_register(GstPlugin *plugin)
+{
+    GST_DEBUG_CATEGORY_INIT(gst_mock_lens_debug, "mocklens", 0, "Simulated lens of the multifocus tests");
+
+    return gst_element_register(plugin, "mocklens", GST_RANK_NONE, GST_TYPE_MOCK_LENS);
+}
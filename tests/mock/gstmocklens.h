@@ -0,0 +1,44 @@
+#ifndef __GST_MOCK_LENS_H__
+#define __GST_MOCK_LENS_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstbasetransform.h>
+#include <gst/video/video.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_MOCK_LENS (gst_mock_lens_get_type())
+#define GST_MOCK_LENS(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_MOCK_LENS, GstMockLens))
+
+typedef struct _GstMockLens GstMockLens;
+typedef struct _GstMockLensClass GstMockLensClass;
+
+/**
+ * @brief Blurs GRAY8 frames as the simulated lens of mockLens.h, driven by the
+ * test build of multifocus, would. Only registered by that build, upstream of multifocus.
+ */
+struct _GstMockLens
+{
+    GstBaseTransform element;
+
+    GstVideoInfo info;          // Negotiated frames
+};
+
+struct _GstMockLensClass
+{
+    GstBaseTransformClass parent_class;
+};
+
+GType gst_mock_lens_get_type(void);
+
+/**
+ * @brief Register the "mocklens" element
+ *
+ * @param plugin The test build of the multifocus plugin
+ * @return gboolean TRUE on success
+ */
+gboolean gst_mock_lens_register(GstPlugin *plugin);
+
+G_END_DECLS
+
+#endif /* __GST_MOCK_LENS_H__ */
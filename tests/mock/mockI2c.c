@@ -0,0 +1,57 @@
+/*
+ * The lens calls of i2c_control.h on the simulated lens of mockLens.h,
+ * linked in place of i2c_control.c in the test build of the plugin: no bus
+ * is opened and the PDA written only reaches the frames blurred by the
+ * "mocklens" element.
+ */
+
+#include "i2c_control.h"
+#include "mockLens.h"
+
+#include <string.h>
+
+int i2cInit(I2CDevice *device, I2CDevice *devicepda, int *bus)
+{
+    *bus = -1;
+    memset(device, 0, sizeof(*device));
+    memset(devicepda, 0, sizeof(*devicepda));
+
+    return 0;
+}
+
+void initDevice(I2CDevice *device, int bus, int addr, int pageByte, int iaddrBytes)
+{
+    memset(device, 0, sizeof(*device));
+    device->bus = bus;
+    device->addr = addr;
+    device->page_bytes = pageByte;
+    device->iaddr_bytes = iaddrBytes;
+}
+
+int enable_VdacPda(I2CDevice device, int bus)
+{
+    return 0;
+}
+
+int disable_VdacPda(I2CDevice device, int bus)
+{
+    return 0;
+}
+
+int write_VdacPda(I2CDevice device, int bus, int PdaRegValue)
+{
+    // Same range as the DAC of the real lens
+    if (PdaRegValue > 879)
+        PdaRegValue = 879;
+    else if (PdaRegValue < -91)
+        PdaRegValue = -91;
+
+    mockLensWrite(PdaRegValue);
+
+    return 0;
+}
+
+int testPattern(I2CDevice device, int bus)
+{
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include "mockLens.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MOCK_PDA_PER_PIXEL 20       // Defocus, in PDA, adding one pixel to the blur radius
+#define MOCK_MAX_RADIUS 8           // Blur radius of the farthest objects
+
+static int configured = 0;
+static int delay = 3;
+static int focus[MOCK_LENS_MAX_PLANES] = { -50, 350 };
+static int nbFocus = 2;
+
+static int commanded = 0;               // Last PDA written
+static int position = 0;                // PDA seen by the last frame
+static int history[MOCK_LENS_MAX_DELAY];   // PDA written before each of the last frames
+static int historyPos = 0;
+
+/* Read the environment once */
+static void mockLensConfigure(void)
+{
+    const char *value;
+
+    if (__atomic_load_n(&configured, __ATOMIC_ACQUIRE))
+        return;
+
+    value = getenv("MULTIFOCUS_MOCK_DELAY");
+    if (value != NULL)
+    {
+        delay = atoi(value);
+        if (delay < 1)
+            delay = 1;
+        if (delay > MOCK_LENS_MAX_DELAY)
+            delay = MOCK_LENS_MAX_DELAY;
+    }
+
+    value = getenv("MULTIFOCUS_MOCK_FOCUS");
+    if (value != NULL && value[0] != '\0')
+    {
+        char *end;
+
+        nbFocus = 0;
+        while (nbFocus < MOCK_LENS_MAX_PLANES)
+        {
+            long int pda = strtol(value, &end, 10);
+
+            if (end == value)
+                break;
+            focus[nbFocus++] = (int)pda;
+            if (*end != ';')
+                break;
+            value = end + 1;
+        }
+        if (nbFocus == 0)
+        {
+            fprintf(stderr, "Invalid MULTIFOCUS_MOCK_FOCUS, using a single band at PDA 0\n");
+            focus[0] = 0;
+            nbFocus = 1;
+        }
+    }
+
+    __atomic_store_n(&configured, 1, __ATOMIC_RELEASE);
+}
+
+void mockLensWrite(int pda)
+{
+    // Written from the streaming thread and the ramp thread, the latest wins
+    __atomic_store_n(&commanded, pda, __ATOMIC_RELAXED);
+}
+
+int mockLensPosition(void)
+{
+    return __atomic_load_n(&position, __ATOMIC_RELAXED);
+}
+
+int mockLensFocus(int band)
+{
+    mockLensConfigure();
+
+    return (band >= 0 && band < nbFocus) ? focus[band] : 0;
+}
+
+int mockLensBands(void)
+{
+    mockLensConfigure();
+
+    return nbFocus;
+}
+
+/* Box blur of one line of samples, stride apart, with the edges clamped */
+static void blurLine(unsigned char *line, int length, int stride, int radius, unsigned int *sums)
+{
+    sums[0] = 0;
+    for (int i = 0; i < length; i++)
+        sums[i + 1] = sums[i] + line[i * stride];
+
+    for (int i = 0; i < length; i++)
+    {
+        int first = (i - radius < 0) ? 0 : i - radius;
+        int last = (i + radius >= length) ? length - 1 : i + radius;
+
+        line[i * stride] = (unsigned char)((sums[last + 1] - sums[first]) / (last - first + 1));
+    }
+}
+
+void mockLensFrame(unsigned char *img, int width, int height, int stride)
+{
+    unsigned int *sums;
+    int seen;
+
+    mockLensConfigure();
+
+    // The frame shows the PDA written while the frame delay frames before it was processed
+    history[historyPos] = __atomic_load_n(&commanded, __ATOMIC_RELAXED);
+    historyPos = (historyPos + 1) % delay;
+    seen = history[historyPos];
+    __atomic_store_n(&position, seen, __ATOMIC_RELAXED);
+
+    sums = (unsigned int *)malloc(sizeof(unsigned int) * ((width > height ? width : height) + 1));
+    if (sums == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory\n");
+        return;
+    }
+
+    for (int band = 0; band < nbFocus; band++)
+    {
+        int x0 = (width * band) / nbFocus;
+        int x1 = (width * (band + 1)) / nbFocus;
+        int radius = abs(seen - focus[band]) / MOCK_PDA_PER_PIXEL;
+
+        if (radius > MOCK_MAX_RADIUS)
+            radius = MOCK_MAX_RADIUS;
+        if (radius == 0)
+            continue;
+
+        for (int y = 0; y < height; y++)
+            blurLine(img + (y * stride) + x0, x1 - x0, 1, radius, sums);
+        for (int x = x0; x < x1; x++)
+            blurLine(img + x, height, stride, radius, sums);
+    }
+
+    free(sums);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#define MOCK_LENS_MAX_DELAY 16      // Largest number of frames before a written PDA reaches the image
+#define MOCK_LENS_MAX_PLANES 8      // Largest number of objects at a distinct focus
+
+/*
+ * Simulated lens of the test build of the plugin, configured by the environment:
+ * MULTIFOCUS_MOCK_DELAY is the number of frames before a PDA is seen, 3 by default as the "latency" property,
+ * MULTIFOCUS_MOCK_FOCUS the PDA in focus of each vertical band of the frame, "-50;350" by default
+ */
+
+/**
+ * @brief Command the simulated lens, as write_VdacPda does with the real one
+ *
+ * @param pda The PDA value, already clamped
+ */
+void mockLensWrite(int pda);
+
+/**
+ * @brief Get the PDA value seen by the last frame given to mockLensFrame
+ *
+ * @return int The PDA value
+ */
+int mockLensPosition(void);
+
+/**
+ * @brief Blur a GRAY8 frame as the simulated lens would, to be called once per frame
+ * Each vertical band of the frame is blurred by its distance to its focus PDA
+ *
+ * @param img The frame, modified in place
+ * @param width The width of the frame
+ * @param height The height of the frame
+ * @param stride The number of bytes between two lines of the frame
+ */
+void mockLensFrame(unsigned char *img, int width, int height, int stride);
+
+/**
+ * @brief Get the PDA in focus of a band of the simulated scene
+ *
+ * @param band The index of the band
+ * @return int The PDA value, 0 if there is no such band
+ */
+int mockLensFocus(int band);
+
+/**
+ * @brief Get the number of bands of the simulated scene
+ *
+ * @return int The number of bands
+ */
+int mockLensBands(void);